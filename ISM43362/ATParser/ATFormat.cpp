@@ -0,0 +1,118 @@
+/* ATFormat - formatting of the AT commands
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <string.h>
+#include "ATFormat.h"
+
+int format_command(char *buffer, int size, const char *format, va_list args)
+{
+    static const char digits[] = "0123456789abcdef0123456789ABCDEF";
+    int len = 0;
+
+    while (*format) {
+        if (*format != '%') {
+            if (len >= size) {
+                return -1;
+            }
+            buffer[len++] = *format++;
+            continue;
+        }
+        format++;
+
+        char pad = ' ';
+        int width = 0;
+        if (*format == '0') {
+            pad = '0';
+            format++;
+        }
+        // A width past the buffer overflows anyway, it is clamped so that
+        // the arithmetic below does not
+        while (*format >= '0' && *format <= '9') {
+            if (width <= size) {
+                width = 10*width + (*format - '0');
+            }
+            format++;
+        }
+
+        // Numbers are converted backwards from the end of tmp
+        char tmp[12];
+        char *end = tmp + sizeof(tmp);
+        char *ptr = end;
+        const char *str;
+        int str_len;
+        bool negative = false;
+
+        switch (*format++) {
+            case 'd':
+            case 'u':
+            case 'x':
+            case 'X': {
+                char conversion = format[-1];
+                unsigned int base = (conversion == 'd' || conversion == 'u') ? 10 : 16;
+                const char *set = (conversion == 'X') ? digits + 16 : digits;
+                unsigned int value = va_arg(args, unsigned int);
+                if (conversion == 'd' && (int)value < 0) {
+                    negative = true;
+                    value = 0u - value;
+                }
+                do {
+                    *--ptr = set[value % base];
+                    value /= base;
+                } while (value);
+                str = ptr;
+                str_len = end - ptr;
+                break;
+            }
+            case 'c':
+                *--ptr = (char)va_arg(args, int);
+                str = ptr;
+                str_len = 1;
+                break;
+            case '%':
+                *--ptr = '%';
+                str = ptr;
+                str_len = 1;
+                break;
+            case 's':
+                str = va_arg(args, const char *);
+                if (str == NULL) {
+                    return -1;
+                }
+                str_len = strlen(str);
+                break;
+            default:
+                return -1;
+        }
+
+        int need = str_len + (negative ? 1 : 0);
+        int fill = width - need;
+        if (need > size - len || fill > size - len - need) {
+            return -1;
+        }
+        if (negative && pad == '0') {
+            buffer[len++] = '-';
+        }
+        for (; fill > 0; fill--) {
+            buffer[len++] = pad;
+        }
+        if (negative && pad != '0') {
+            buffer[len++] = '-';
+        }
+        memcpy(buffer + len, str, str_len);
+        len += str_len;
+    }
+
+    return len;
+}
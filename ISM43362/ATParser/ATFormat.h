@@ -0,0 +1,35 @@
+/* ATFormat - formatting of the AT commands
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef AT_FORMAT_H
+#define AT_FORMAT_H
+
+#include <stdarg.h>
+
+/**
+* Command formatting, bounded and without allocation
+*
+* Only the conversions of the AT commands are handled: %d %u %x %X %c %s
+* and %%, with an optional '0' flag and width.
+*
+* @param buffer buffer to write the command to
+* @param size size of the buffer
+* @param format format string of the command
+* @param args arguments of the conversions
+* @return length written, or -1 on overflow or on an unsupported
+*   conversion, the output is not null terminated
+*/
+int format_command(char *buffer, int size, const char *format, va_list args);
+
+#endif
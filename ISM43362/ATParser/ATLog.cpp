@@ -0,0 +1,138 @@
+/* ATLog - binary trace log of the AT exchanges
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "ATLog.h"
+
+#if (AT_LOG_SIZE & (AT_LOG_SIZE - 1)) != 0
+#error "AT_LOG_SIZE must be a power of two"
+#endif
+
+static const char *const event_names[] = {
+    "?", "AT>", "AT> data", "AT> too long", "AT<", "AT< incomplete",
+    "AT<", "AT=", "AT< >", "AT!", "AT< read", "AT< late",
+};
+
+ATLog::ATLog() : _head(0), _tail(0), _lost(0), _lost_printed(0)
+{
+    memset(_records, 0, sizeof(_records));
+}
+
+void ATLog::log(event event, uint32_t arg0, uint32_t arg1)
+{
+    // Reserve a record, writers never wait for each other
+    uint32_t seq = core_util_atomic_incr_u32(&_head, 1);
+    record &r = _records[(seq - 1) & (AT_LOG_SIZE - 1)];
+
+    r.seq = 0;
+    __DMB();
+    r.time_us = us_ticker_read();
+    r.event = event;
+    r.arg0 = arg0;
+    r.arg1 = arg1;
+    __DMB();
+    r.seq = seq;
+}
+
+uint32_t ATLog::pack(const char *data, int len)
+{
+    uint32_t packed = 0;
+    for (int i = 0; i < len && i < 4; i++) {
+        packed |= (uint32_t)(uint8_t)data[i] << (8*i);
+    }
+    return packed;
+}
+
+int ATLog::drain(record *records, int count)
+{
+    uint32_t head = _head;
+    int n = 0;
+
+    // Records older than the size of the log are gone
+    if (head - _tail > AT_LOG_SIZE) {
+        _lost += head - _tail - AT_LOG_SIZE;
+        _tail = head - AT_LOG_SIZE;
+    }
+
+    while ((n < count) && (_tail != head)) {
+        const record &r = _records[_tail & (AT_LOG_SIZE - 1)];
+        uint32_t expected = _tail + 1;
+
+        uint32_t seq = r.seq;
+        if (seq == 0) {
+            // Still being written, take it next time
+            break;
+        }
+        __DMB();
+        records[n].time_us = r.time_us;
+        records[n].event = r.event;
+        records[n].arg0 = r.arg0;
+        records[n].arg1 = r.arg1;
+        __DMB();
+        _tail++;
+        if ((seq != expected) || (r.seq != expected)) {
+            // Overwritten by a newer record while it was read
+            _lost++;
+            continue;
+        }
+        records[n].seq = seq;
+        n++;
+    }
+
+    return n;
+}
+
+void ATLog::print()
+{
+    record records[8];
+    int n;
+
+    while ((n = drain(records, sizeof(records) / sizeof(records[0]))) > 0) {
+        for (int i = 0; i < n; i++) {
+            const record &r = records[i];
+            char text[5];
+            for (int j = 0; j < 4; j++) {
+                char c = (char)(r.arg0 >> (8*j));
+                text[j] = (c >= ' ' && c <= '~') ? c : (c ? '.' : 0);
+            }
+            text[4] = 0;
+
+            const char *name = (r.event < sizeof(event_names) / sizeof(event_names[0])) ?
+                               event_names[r.event] : event_names[0];
+            switch (r.event) {
+                case AT_LOG_RESPONSE:
+                    printf("%10lu %s %d (%lu us)\r\n", (unsigned long)r.time_us, name,
+                           (int)r.arg0, (unsigned long)r.arg1);
+                    break;
+                case AT_LOG_INCOMPLETE:
+                case AT_LOG_LATE:
+                    printf("%10lu %s %lu bytes\r\n", (unsigned long)r.time_us, name,
+                           (unsigned long)r.arg1);
+                    break;
+                case AT_LOG_PROMPT:
+                    printf("%10lu %s\r\n", (unsigned long)r.time_us, name);
+                    break;
+                default:
+                    printf("%10lu %s %s.. (%lu)\r\n", (unsigned long)r.time_us, name,
+                           text, (unsigned long)r.arg1);
+                    break;
+            }
+        }
+    }
+
+    if (_lost != _lost_printed) {
+        printf("AT log: %lu records lost\r\n", (unsigned long)(_lost - _lost_printed));
+        _lost_printed = _lost;
+    }
+}
@@ -0,0 +1,114 @@
+/* ATLog - binary trace log of the AT exchanges
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef AT_LOG_H
+#define AT_LOG_H
+
+#include "mbed.h"
+
+/* Number of records the log keeps, a power of two. Older records are
+ * overwritten when they are not drained in time.
+ */
+#ifndef AT_LOG_SIZE
+#define AT_LOG_SIZE 64
+#endif
+
+/**
+* Ring of fixed size records, written without locks or console output
+*
+* Any thread or interrupt may add records, a single consumer drains them,
+* either through print() from a low priority context or by reading the
+* raw records out of memory with a debugger.
+*/
+class ATLog
+{
+public:
+    /**
+    * Events of the log, the meaning of the arguments depends on the event
+    */
+    enum event {
+        AT_LOG_COMMAND = 1, // arg0: start of the command, arg1: length
+        AT_LOG_DATA,        // arg0: start of the command, arg1: length of the data
+        AT_LOG_TOO_LONG,    // arg0: start of the command that did not fit
+        AT_LOG_RESPONSE,    // arg0: nsapi error, arg1: time of the transaction in us
+        AT_LOG_INCOMPLETE,  // arg1: bytes received without the prompt
+        AT_LOG_LINE,        // arg0: start of the line, arg1: length
+        AT_LOG_MATCH,       // arg0: start of the line, arg1: length
+        AT_LOG_PROMPT,      // the prompt came before the expected lines
+        AT_LOG_OOB,         // arg0: start of the out-of-band prefix
+        AT_LOG_READ,        // arg0: start of the data, arg1: length
+        AT_LOG_LATE,        // arg1: bytes of a timed out response discarded
+    };
+
+    struct record {
+        // Position of the record in the log, 0 while it is being written
+        volatile uint32_t seq;
+        uint32_t time_us;
+        uint32_t event;
+        uint32_t arg0;
+        uint32_t arg1;
+    };
+
+    ATLog();
+
+    /**
+    * Add a record, safe from any context
+    *
+    * @param event one of the events
+    * @param arg0 first argument of the event
+    * @param arg1 second argument of the event
+    */
+    void log(event event, uint32_t arg0 = 0, uint32_t arg1 = 0);
+
+    /**
+    * Pack up to the first four bytes of a text in an argument
+    *
+    * @param data text to pack
+    * @param len length of the text
+    * @return the bytes in memory order, padded with zeros
+    */
+    static uint32_t pack(const char *data, int len);
+
+    /**
+    * Take the oldest records out of the log
+    *
+    * @param records destination for the records, in order
+    * @param count number of records the destination can hold
+    * @return number of records copied
+    */
+    int drain(record *records, int count);
+
+    /**
+    * Get the number of records overwritten before they were drained
+    */
+    uint32_t get_lost() const {
+        return _lost;
+    }
+
+    /**
+    * Drain the log and print its records as text
+    */
+    void print();
+
+private:
+    record _records[AT_LOG_SIZE];
+    // Number of records added so far
+    volatile uint32_t _head;
+    // Number of records drained so far, including the lost ones
+    uint32_t _tail;
+    uint32_t _lost;
+    uint32_t _lost_printed;
+};
+
+#endif
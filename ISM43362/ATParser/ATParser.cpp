@@ -19,8 +19,47 @@
  */
 
 #include "ATParser.h"
-#include "mbed_debug.h"
+#include "ATFormat.h"
+
+// Error texts of the device, checked in order on ERROR lines
+static const struct {
+    const char *text;
+    nsapi_error_t error;
+} response_errors[] = {
+    { "Usage",          NSAPI_ERROR_PARAMETER },
+    { "Invalid",        NSAPI_ERROR_PARAMETER },
+    { "Timeout",        NSAPI_ERROR_TIMEOUT },
+    { "Not connected",  NSAPI_ERROR_NO_CONNECTION },
+    { "Connection",     NSAPI_ERROR_NO_CONNECTION },
+    { "Socket",         NSAPI_ERROR_NO_SOCKET },
+    { "memory",         NSAPI_ERROR_NO_MEMORY },
+};
+
+// Error reported by a response line without its delimiter, a failed command
+// is answered with an ERROR line or a lone -1
+static nsapi_error_t response_error(const char *line, int len)
+{
+    if (len == 2 && memcmp(line, "-1", 2) == 0) {
+        return NSAPI_ERROR_DEVICE_ERROR;
+    }
+    if (len < 5 || memcmp(line, "ERROR", 5) != 0) {
+        return NSAPI_ERROR_OK;
+    }
+    for (unsigned i = 0; i < sizeof(response_errors) / sizeof(response_errors[0]); i++) {
+        int text_len = strlen(response_errors[i].text);
+        for (int j = 5; j + text_len <= len; j++) {
+            if (memcmp(line + j, response_errors[i].text, text_len) == 0) {
+                return response_errors[i].error;
+            }
+        }
+    }
+    return NSAPI_ERROR_DEVICE_ERROR;
+}
 
+static bool span_ends_with(const char *start, const char *end, const char *suffix, int len)
+{
+    return (end - start >= len) && (memcmp(end - len, suffix, len) == 0);
+}
 
 // getc/putc handling with timeouts
 int ATParser::putc(char c)
@@ -83,7 +122,7 @@ int ATParser::read(char *data, int size)
         }
         data[i] = c;
     }
-    debug_if(dbg_on, "AT< %s\r\n", data);
+    log(ATLog::AT_LOG_READ, ATLog::pack(data, i), i);
     return i;
 }
 
@@ -91,9 +130,11 @@ int ATParser::read(char *data, int size)
 // printf/scanf handling
 int ATParser::vprintf(const char *format, va_list args)
 {
-    if (vsprintf(_buffer, format, args) < 0) {
-        return false;
+    int len = format_command(_buffer, _buffer_size - 1, format, args);
+    if (len < 0) {
+        return -1;
     }
+    _buffer[len] = 0;
     int i = 0;
     for ( ; _buffer[i]; i++) {
         if (putc(_buffer[i]) < 0) {
@@ -169,19 +210,19 @@ int ATParser::vscanf(const char *format, va_list args)
 bool ATParser::vsend(const char *command, va_list args)
 {
     int i=0, j=0;
-    // Create and send command
-    if (vsprintf(_buffer, command, args) < 0) {
+    // Create and send command, leaving room for the delimiter
+    i = format_command(_buffer, _buffer_size - _delim_size - 1, command, args);
+    if (i < 0) {
+        log(ATLog::AT_LOG_TOO_LONG, ATLog::pack(command, strlen(command)));
         return false;
     }
-    /* get buffer length */
-    for (i = 0; _buffer[i]; i++) {
-    }
     for (j=0; _delimiter[j]; j++) {
         _buffer[i+j] = _delimiter[j];
     }
     _buffer[i+j]=0; // only to get a clean debug log
- //   _buffer[i+j+2]=0; // only to get a clean debug log
-    
+
+    /* drop what is left of the previous response, such as its prompt */
+    flush();
     _serial_spi->write(_buffer, i+j); /* DEBUG : check returned value */
 #if 0    
     /* flush buffer from previous message */
@@ -201,12 +242,34 @@ bool ATParser::vsend(const char *command, va_list args)
         }
     }
 #endif
-    debug_if(dbg_on, "AT> %s\r\n", _buffer);
+    log(ATLog::AT_LOG_COMMAND, ATLog::pack(_buffer, i), i);
+    return true;
+}
+
+bool ATParser::send_data(const void *data, int size, const char *command, ...)
+{
+    va_list args;
+    va_start(args, command);
+    int len = format_command(_buffer, _buffer_size, command, args);
+    va_end(args);
+
+    if ((len < 0) || (size < 0) || (len + size > _buffer_size)) {
+        return false;
+    }
+    memcpy(_buffer + len, data, size);
+
+    flush();
+    if (_serial_spi->write(_buffer, len + size) != len + size) {
+        return false;
+    }
+    log(ATLog::AT_LOG_DATA, ATLog::pack(_buffer, len), size);
     return true;
 }
 
 bool ATParser::vrecv(const char *response, va_list args)
 {
+    _error = NSAPI_ERROR_OK;
+
     /* Read from the wifi module, fill _rxbuffer */
     _serial_spi->read();
     
@@ -252,16 +315,25 @@ bool ATParser::vrecv(const char *response, va_list args)
             // Recieve next character
             int c = getc();
             if (c < 0) {
+                // The response ended without its prompt
+                _error = NSAPI_ERROR_TIMEOUT;
                 return false;
             }
             _buffer[offset + j++] = c;
             _buffer[offset + j] = 0;
 
+            // The prompt ends every response, the expected lines did not come
+            if (j == 2 && memcmp(_buffer + offset, "> ", 2) == 0) {
+                log(ATLog::AT_LOG_PROMPT);
+                _error = NSAPI_ERROR_DEVICE_ERROR;
+                return false;
+            }
+
             // Check for oob data
             for (int k = 0; k < _oobs.size(); k++) {
                 if (j == _oobs[k].len && memcmp(
                         _oobs[k].prefix, _buffer+offset, _oobs[k].len) == 0) {
-                    debug_if(dbg_on, "AT! %s\r\n", _oobs[k].prefix);
+                    log(ATLog::AT_LOG_OOB, ATLog::pack(_oobs[k].prefix, _oobs[k].len));
                     _oobs[k].cb();
 
                     // oob may have corrupted non-reentrant buffer,
@@ -276,7 +348,7 @@ bool ATParser::vrecv(const char *response, va_list args)
 
             // We only succeed if all characters in the response are matched
             if (count == j) {
-                debug_if(dbg_on, "AT= %s\r\n", _buffer+offset);
+                log(ATLog::AT_LOG_MATCH, ATLog::pack(_buffer+offset, j), j);
                 // Reuse the front end of the buffer
                 memcpy(_buffer, response, i);
                 _buffer[i] = 0;
@@ -294,7 +366,15 @@ bool ATParser::vrecv(const char *response, va_list args)
             if (j+1 >= _buffer_size - offset ||
                 strcmp(&_buffer[offset + j-_delim_size], _delimiter) == 0) {
 
-                debug_if(dbg_on, "AT< %s", _buffer+offset);
+                log(ATLog::AT_LOG_LINE, ATLog::pack(_buffer+offset, j), j);
+
+                // A failed command ends its response, fail right away
+                if (j+1 < _buffer_size - offset) {
+                    _error = response_error(_buffer+offset, j-_delim_size);
+                    if (_error != NSAPI_ERROR_OK) {
+                        return false;
+                    }
+                }
                 j = 0;
             }
         }
@@ -341,6 +421,385 @@ bool ATParser::recv(const char *response, ...)
     return res;
 }
 
+bool ATParser::transact(result &res, const char *command, ...)
+{
+    va_list args;
+    va_start(args, command);
+    bool ok = vtransact(res, NULL, 0, command, args);
+    va_end(args);
+    return ok;
+}
+
+bool ATParser::transact_data(result &res, const void *data, int size, const char *command, ...)
+{
+    va_list args;
+    va_start(args, command);
+    bool ok = vtransact(res, data, size, command, args);
+    va_end(args);
+    return ok;
+}
+
+bool ATParser::transact(result &res, const frame &command)
+{
+    log(ATLog::AT_LOG_COMMAND, ATLog::pack(command.data, command.len), command.len);
+    return exchange(res, command.data, command.len);
+}
+
+bool ATParser::transact(result &res, const frame &prefix, int value)
+{
+    // Decimal conversion of the value, backwards from the end of tmp
+    char tmp[11];
+    char *end = tmp + sizeof(tmp);
+    char *ptr = end;
+    unsigned int u = (value < 0) ? 0u - (unsigned int)value : (unsigned int)value;
+    do {
+        *--ptr = '0' + (u % 10);
+        u /= 10;
+    } while (u);
+    if (value < 0) {
+        *--ptr = '-';
+    }
+    return vtransact_value(res, prefix, ptr, end - ptr);
+}
+
+bool ATParser::transact(result &res, const frame &prefix, const char *value)
+{
+    if (value == NULL) {
+        res.error = _error = NSAPI_ERROR_PARAMETER;
+        return false;
+    }
+    return vtransact_value(res, prefix, value, strlen(value));
+}
+
+// prefix and value joined in the buffer, no format string is involved
+bool ATParser::vtransact_value(result &res, const frame &prefix, const char *value, int size)
+{
+    int len = prefix.len + size;
+    if (len + _delim_size > _buffer_size) {
+        log(ATLog::AT_LOG_TOO_LONG, ATLog::pack(prefix.data, prefix.len));
+        res.error = _error = NSAPI_ERROR_PARAMETER;
+        return false;
+    }
+    memcpy(_buffer, prefix.data, prefix.len);
+    memcpy(_buffer + prefix.len, value, size);
+    log(ATLog::AT_LOG_COMMAND, ATLog::pack(_buffer, len), len);
+    memcpy(_buffer + len, _delimiter, _delim_size);
+    return exchange(res, _buffer, len + _delim_size);
+}
+
+// formatted transaction
+bool ATParser::vtransact(result &res, const void *data, int size, const char *command, va_list args)
+{
+    // Build the command with its data or delimiter, in one transfer
+    int len = format_command(_buffer, _buffer_size, command, args);
+    if ((len < 0) || (size < 0)) {
+        log(ATLog::AT_LOG_TOO_LONG, ATLog::pack(command, strlen(command)));
+        res.error = _error = NSAPI_ERROR_PARAMETER;
+        return false;
+    }
+    if (data) {
+        if (len + size > _buffer_size) {
+            res.error = _error = NSAPI_ERROR_PARAMETER;
+            return false;
+        }
+        memcpy(_buffer + len, data, size);
+        log(ATLog::AT_LOG_DATA, ATLog::pack(_buffer, len), size);
+        len += size;
+    } else {
+        if (len + _delim_size > _buffer_size) {
+            res.error = _error = NSAPI_ERROR_PARAMETER;
+            return false;
+        }
+        log(ATLog::AT_LOG_COMMAND, ATLog::pack(_buffer, len), len);
+        memcpy(_buffer + len, _delimiter, _delim_size);
+        len += _delim_size;
+    }
+
+    return exchange(res, _buffer, len);
+}
+
+// time left of the budget set by setTimeout()
+int ATParser::remaining()
+{
+    int elapsed = (us_ticker_read() - _start) / 1000;
+    return (elapsed < _timeout) ? _timeout - elapsed : 0;
+}
+
+// discard a response the module finished after its exchange timed out
+bool ATParser::drain()
+{
+    while (_pending) {
+        // Dataready stays low while the module is still busy with it
+        int budget = remaining();
+        if (!budget || !_serial_spi->wait_dataready(1, budget)) {
+            return false;
+        }
+        _serial_spi->set_timeout(max(remaining(), 1));
+        int n = _serial_spi->read();
+        _serial_spi->set_timeout(_timeout);
+        flush();
+        if (n >= 0) {
+            log(ATLog::AT_LOG_LATE, 0, n);
+            _pending = false;
+        }
+    }
+    return true;
+}
+
+// single frame exchange
+bool ATParser::exchange(result &res, const char *command, int len)
+{
+    uint32_t begin = us_ticker_read();
+#if AT_TRACE
+    // The command may be in the buffer the response overwrites
+    char name[2] = { command[0], (len > 1) ? command[1] : '\0' };
+#endif
+
+    res.error = NSAPI_ERROR_OK;
+    res.time_us = 0;
+    res.body.ptr = _buffer;
+    res.body.len = 0;
+    res.count = 0;
+
+    // A response the module finished after an earlier exchange gave up on
+    // it would be taken for the response to this command
+    bool drained = !_pending || drain();
+    int budget = remaining();
+    if (!drained || !budget) {
+        res.time_us = us_ticker_read() - begin;
+        res.error = _error = NSAPI_ERROR_TIMEOUT;
+        log(ATLog::AT_LOG_RESPONSE, (uint32_t)res.error, res.time_us);
+        return false;
+    }
+
+    flush();
+    _serial_spi->set_timeout(budget);
+    int written = _serial_spi->write(command, len);
+    _serial_spi->set_timeout(_timeout);
+    if (written != len) {
+        res.error = _error = (written < 0) ? NSAPI_ERROR_TIMEOUT : NSAPI_ERROR_DEVICE_ERROR;
+        log(ATLog::AT_LOG_RESPONSE, (uint32_t)res.error, us_ticker_read() - begin);
+        return false;
+    }
+#if AT_TRACE
+    uint32_t sent = us_ticker_read();
+#endif
+
+    // The module raises dataready once its response is ready, within what
+    // is left of the budget. From now on it owes the response.
+    budget = remaining();
+    if (!budget || !_serial_spi->wait_dataready(1, budget)) {
+        _pending = true;
+        res.time_us = us_ticker_read() - begin;
+        res.error = _error = NSAPI_ERROR_TIMEOUT;
+        log(ATLog::AT_LOG_RESPONSE, (uint32_t)res.error, res.time_us);
+        return false;
+    }
+#if AT_TRACE
+    uint32_t ready = us_ticker_read();
+#endif
+
+    // The whole response comes in one frame, the buffer is reused for it.
+    // A frame cut by the budget is incomplete, its rest is drained later.
+    _serial_spi->set_timeout(max(remaining(), 1));
+    if (_serial_spi->read() < 0) {
+        _pending = true;
+    }
+    _serial_spi->set_timeout(_timeout);
+    int n = 0;
+    while (_serial_spi->readable() && (n < _buffer_size - 1)) {
+        _buffer[n++] = _serial_spi->getc();
+    }
+    flush();
+    _buffer[n] = 0;
+    res.time_us = us_ticker_read() - begin;
+
+#if AT_TRACE
+    uint32_t phase_us[AT_PHASE_COUNT];
+    phase_us[AT_PHASE_QUEUE] = _queue_us;
+    phase_us[AT_PHASE_TRANSMIT] = sent - begin;
+    phase_us[AT_PHASE_MODULE] = ready - sent;
+    phase_us[AT_PHASE_RECEIVE] = begin + res.time_us - ready;
+    _queue_us = 0;
+    trace(name, phase_us);
+#endif
+
+    // Frames end with the status line and the prompt
+    const char *start = _buffer;
+    const char *end = _buffer + n;
+    if (!span_ends_with(start, end, "> ", 2)) {
+        log(ATLog::AT_LOG_INCOMPLETE, 0, n);
+        res.error = _error = NSAPI_ERROR_TIMEOUT;
+        return false;
+    }
+    end -= 2;
+    if (span_ends_with(start, end, _delimiter, _delim_size)) {
+        end -= _delim_size;
+    }
+    const char *status = end;
+    while ((status > start) && !span_ends_with(start, status, _delimiter, _delim_size)) {
+        status--;
+    }
+    if ((end - status == 2) && (memcmp(status, "OK", 2) == 0)) {
+        res.error = NSAPI_ERROR_OK;
+    } else {
+        res.error = response_error(status, end - status);
+        if (res.error == NSAPI_ERROR_OK) {
+            res.error = NSAPI_ERROR_DEVICE_ERROR;
+        }
+    }
+    _error = res.error;
+    log(ATLog::AT_LOG_RESPONSE, (uint32_t)res.error, res.time_us);
+
+    // The body lies between the opening delimiter and the status line
+    if ((start + _delim_size <= status) && (memcmp(start, _delimiter, _delim_size) == 0)) {
+        start += _delim_size;
+    }
+    const char *body_end = status;
+    if ((body_end - start >= _delim_size) && span_ends_with(start, body_end, _delimiter, _delim_size)) {
+        body_end -= _delim_size;
+    }
+    if (body_end < start) {
+        body_end = start;
+    }
+    res.body.ptr = start;
+    res.body.len = body_end - start;
+
+    const char *line = start;
+    while ((line < body_end) && (res.count < AT_RESULT_LINES)) {
+        const char *line_end = line;
+        while ((line_end + _delim_size <= body_end) && (memcmp(line_end, _delimiter, _delim_size) != 0)) {
+            line_end++;
+        }
+        if (line_end + _delim_size > body_end) {
+            line_end = body_end;
+        }
+        res.lines[res.count].ptr = line;
+        res.lines[res.count].len = line_end - line;
+        res.count++;
+        line = line_end + _delim_size;
+    }
+
+    return res.error == NSAPI_ERROR_OK;
+}
+
+
+// latency tracing
+#if AT_TRACE
+void ATParser::trace(const char *name, const uint32_t *phase_us)
+{
+    latency *entry = NULL;
+    for (int i = 0; i < AT_TRACE_COMMANDS; i++) {
+        if (_latency[i].count == 0 ||
+            (_latency[i].command[0] == name[0] && _latency[i].command[1] == name[1])) {
+            entry = &_latency[i];
+            break;
+        }
+    }
+    if (entry == NULL) {
+        // Table full, the command is not traced
+        return;
+    }
+
+    uint32_t total = 0;
+    for (int i = 0; i < AT_PHASE_COUNT; i++) {
+        entry->total_us[i] += phase_us[i];
+        total += phase_us[i];
+    }
+    int bucket = 0;
+    for (uint32_t t = total >> 8; t && (bucket < AT_TRACE_BUCKETS - 1); t >>= 1) {
+        bucket++;
+    }
+    entry->command[0] = name[0];
+    entry->command[1] = name[1];
+    entry->command[2] = 0;
+    entry->histogram[bucket]++;
+    entry->max_us = max(entry->max_us, total);
+    entry->count++;
+}
+#endif
+
+int ATParser::get_latency(latency *stats, int count)
+{
+    int n = 0;
+#if AT_TRACE
+    for (int i = 0; (i < AT_TRACE_COMMANDS) && (n < count) && _latency[i].count; i++) {
+        stats[n++] = _latency[i];
+    }
+#else
+    (void)stats;
+    (void)count;
+#endif
+    return n;
+}
+
+void ATParser::reset_latency()
+{
+#if AT_TRACE
+    memset(_latency, 0, sizeof(_latency));
+    _queue_us = 0;
+#endif
+}
+
+void ATParser::dump_latency()
+{
+#if AT_TRACE
+    // To the console, the member printf would send it to the module
+    ::printf("cmd    count   max_us   avg: queue   tx   module   rx (us)\r\n");
+    for (int i = 0; (i < AT_TRACE_COMMANDS) && _latency[i].count; i++) {
+        const latency &entry = _latency[i];
+        ::printf("%-4s %7lu %8lu     ", entry.command, (unsigned long)entry.count, (unsigned long)entry.max_us);
+        for (int j = 0; j < AT_PHASE_COUNT; j++) {
+            ::printf(" %6lu", (unsigned long)(entry.total_us[j] / entry.count));
+        }
+        ::printf("\r\n     histogram:");
+        for (int j = 0; j < AT_TRACE_BUCKETS; j++) {
+            ::printf(" %lu", (unsigned long)entry.histogram[j]);
+        }
+        ::printf("\r\n");
+    }
+#endif
+}
+
+
+// unsolicited output processing
+bool ATParser::process_oob()
+{
+    bool handled = false;
+    int j = 0;
+
+    if (!_serial_spi->readable()) {
+        _serial_spi->read();
+    }
+
+    while (_serial_spi->readable()) {
+        int c = getc();
+        // Skip the padding of the SPI frames
+        if (c == 0x15) {
+            continue;
+        }
+        _buffer[j++] = c;
+        _buffer[j] = 0;
+
+        bool matched = false;
+        for (int k = 0; k < _oobs.size(); k++) {
+            if (j == _oobs[k].len && memcmp(_oobs[k].prefix, _buffer, _oobs[k].len) == 0) {
+                log(ATLog::AT_LOG_OOB, ATLog::pack(_oobs[k].prefix, _oobs[k].len));
+                _oobs[k].cb();
+                handled = true;
+                matched = true;
+                break;
+            }
+        }
+
+        if (matched || j+1 >= _buffer_size ||
+            (j >= _delim_size && strcmp(&_buffer[j-_delim_size], _delimiter) == 0)) {
+            j = 0;
+        }
+    }
+
+    return handled;
+}
 
 // oob registration
 void ATParser::oob(const char *prefix, Callback<void()> cb)
@@ -24,6 +24,7 @@
 #include <cstdarg>
 #include <vector>
 #include "BufferedSpi.h"
+#include "ATLog.h"
 #include "Callback.h"
 
 
@@ -44,19 +45,120 @@
 * at.recv("OK");
 * @endcode
 */
+/* Encodes a constant command and its delimiter as a frame, at compile time.
+ * Odd lengths are padded like BufferedSpi does, so that the frame is sent
+ * as whole 16-bit words straight from flash.
+ */
+#define AT_FRAME(command, delimiter) \
+    { command delimiter "\n", (int)((sizeof(command delimiter) - 1 + 1) & ~1) }
+
+/* Encodes the constant part of a command taking one argument */
+#define AT_PREFIX(command) \
+    { command, (int)(sizeof(command) - 1) }
+
+/* Latency tracing of the transactions per command, 0 compiles it out */
+#ifndef AT_TRACE
+#define AT_TRACE 0
+#endif
+
+/* Number of command prefixes the latency tracing keeps apart */
+#ifndef AT_TRACE_COMMANDS
+#define AT_TRACE_COMMANDS 24
+#endif
+
+/* Buckets of the latency histograms: below 256 us, then one per power of
+ * two, the last one holds everything from 2^18 us up
+ */
+#define AT_TRACE_BUCKETS 12
+
+/* Number of response lines a transaction keeps track of */
+#ifndef AT_RESULT_LINES
+#define AT_RESULT_LINES 32
+#endif
+
 class ATParser
 {
+public:
+    /**
+    * Part of a response, valid until the next command
+    */
+    struct span {
+        const char *ptr;
+        int len;
+    };
+
+    /**
+    * Command encoded at compile time, see AT_FRAME() and AT_PREFIX()
+    */
+    struct frame {
+        const char *data;
+        int len;
+    };
+
+    /**
+    * Phases of a transaction, as traced when AT_TRACE is enabled
+    */
+    enum trace_phase {
+        AT_PHASE_QUEUE = 0,     // waiting for the module lock
+        AT_PHASE_TRANSMIT,      // writing the command
+        AT_PHASE_MODULE,        // waiting for the module to raise dataready
+        AT_PHASE_RECEIVE,       // reading the response
+        AT_PHASE_COUNT
+    };
+
+    /**
+    * Latency of the transactions of one command
+    */
+    struct latency {
+        // Two letter prefix of the command, null terminated
+        char command[3];
+        uint32_t count;
+        uint32_t max_us;
+        // Time spent in each phase, summed over all the transactions
+        uint64_t total_us[AT_PHASE_COUNT];
+        // Whole transactions, bucket i > 0 holds [128 << i, 256 << i) us
+        uint32_t histogram[AT_TRACE_BUCKETS];
+    };
+
+    /**
+    * Outcome of transact()
+    */
+    struct result {
+        // NSAPI_ERROR_OK if the response ended with OK
+        nsapi_error_t error;
+        // Time from the command to the end of the response
+        uint32_t time_us;
+        // Everything between the opening delimiter and the status line
+        span body;
+        // Lines of the body without their delimiter, extra lines are only in body
+        int count;
+        span lines[AT_RESULT_LINES];
+    };
+
 private:
     // Serial information
     BufferedSpi *_serial_spi;
     int _buffer_size;
     char *_buffer;
+    // Budget shared by the exchanges until the next setTimeout(), from _start
     int _timeout;
+    uint32_t _start;
+    // The module still owes the response of an exchange that timed out
+    bool _pending;
 
     // Parsing information
     const char *_delimiter;
     int _delim_size;
     bool dbg_on;
+    nsapi_error_t _error;
+
+    // Exchanges recorded while debugging is on, printed later by print_log()
+    ATLog _log;
+    void log(ATLog::event event, uint32_t arg0 = 0, uint32_t arg1 = 0) {
+        if (dbg_on) {
+            _log.log(event, arg0, arg1);
+        }
+    }
 
     struct oob {
         unsigned len;
@@ -65,6 +167,17 @@ private:
     };
     std::vector<oob> _oobs;
 
+#if AT_TRACE
+    latency _latency[AT_TRACE_COMMANDS];
+    uint32_t _queue_us;
+    void trace(const char *name, const uint32_t *phase_us);
+#endif
+
+    bool vtransact_value(result &res, const frame &prefix, const char *value, int size);
+    bool exchange(result &res, const char *command, int len);
+    int remaining();
+    bool drain();
+
 public:
     /**
     * Constructor
@@ -76,8 +189,13 @@ public:
     */
     ATParser(BufferedSpi &serial_spi, const char *delimiter = "\r\n", int buffer_size = 256, int timeout = 8000, bool debug = false) :
         _serial_spi(&serial_spi),
-        _buffer_size(buffer_size) {
+        _buffer_size(buffer_size),
+        _pending(false),
+        _error(NSAPI_ERROR_OK) {
         _buffer = new char[buffer_size];
+#if AT_TRACE
+        reset_latency();
+#endif
         setTimeout(timeout);
         setDelimiter(delimiter);
         debugOn(debug);
@@ -93,10 +211,16 @@ public:
     /**
     * Allows timeout to be changed between commands
     *
-    * @param timeout timeout of the connection
+    * Starts a time budget shared by the following transactions, waits for
+    * the device included. A transaction started or still running past it
+    * fails with NSAPI_ERROR_TIMEOUT.
+    *
+    * @param timeout timeout of the connection in milliseconds
     */
     void setTimeout(int timeout) {
         _timeout = timeout;
+        _start = us_ticker_read();
+        _serial_spi->set_timeout(timeout);
     }
 
     /**
@@ -121,17 +245,85 @@ public:
     /**
     * Sends an AT command
     *
-    * Sends a formatted command using printf style formatting
+    * Sends a formatted command using printf style formatting, limited to
+    * the %d %u %x %X %c %s and %% conversions with an optional '0' flag
+    * and width
     * @see ::printf
     *
     * @param command printf-like format string of command to send which
     *                is appended with the specified delimiter
     * @param ... all printf-like arguments to insert into command
-    * @return true only if command is successfully sent
+    * @return true only if command is successfully sent, false if it does
+    *         not fit in the buffer
     */
     bool send(const char *command, ...);
     bool vsend(const char *command, va_list args);
 
+    /**
+    * Sends an AT command followed by binary data
+    *
+    * The formatted command is not followed by the delimiter, the data is
+    * appended as is and sent in the same transfer.
+    *
+    * @param data binary data to send after the command
+    * @param size number of bytes of data
+    * @param command printf-like format string of command to send
+    * @param ... all printf-like arguments to insert into command
+    * @return true only if command and data are successfully sent
+    */
+    bool send_data(const void *data, int size, const char *command, ...);
+
+    /**
+    * Sends a command and collects its whole response, up to the prompt
+    *
+    * The response is split in place: the lines of the result point into
+    * the parser buffer, no data is copied out of it.
+    *
+    * @param res placeholder for the status, timing and lines of the response
+    * @param command printf-like format string of command to send which
+    *                is appended with the specified delimiter
+    * @param ... all printf-like arguments to insert into command
+    * @return true only if the response ended with OK
+    */
+    bool transact(result &res, const char *command, ...);
+
+    /**
+    * Sends a command followed by binary data and collects its whole response
+    *
+    * @param res placeholder for the status, timing and lines of the response
+    * @param data binary data sent right after the command, without delimiter
+    * @param size number of bytes of data
+    * @param command printf-like format string of command to send
+    * @param ... all printf-like arguments to insert into command
+    * @return true only if the response ended with OK
+    */
+    bool transact_data(result &res, const void *data, int size, const char *command, ...);
+    bool vtransact(result &res, const void *data, int size, const char *command, va_list args);
+
+    /**
+    * Sends a constant command and collects its whole response
+    *
+    * The frame is written as is, no format string is parsed.
+    *
+    * @param res placeholder for the status, timing and lines of the response
+    * @param command frame built with AT_FRAME(), including the delimiter
+    * @return true only if the response ended with OK
+    */
+    bool transact(result &res, const frame &command);
+
+    /**
+    * Sends a command with one argument and collects its whole response
+    *
+    * The argument is appended to the prefix, followed by the delimiter.
+    *
+    * @param res placeholder for the status, timing and lines of the response
+    * @param prefix frame built with AT_PREFIX()
+    * @param value argument, in decimal or as is
+    * @return true only if the response ended with OK
+    */
+    bool transact(result &res, const frame &prefix, int value);
+    bool transact(result &res, const frame &prefix, const char *value);
+
     /**
     * Recieve an AT response
     *
@@ -209,7 +401,7 @@ public:
     * 
     * @param prefix string on when to initiate callback
     * @param func callback to call when string is read
-    * @note out-of-band data is only processed during a scanf call
+    * @note out-of-band data is only processed during a scanf call or by process_oob()
     */
     void oob(const char *prefix, mbed::Callback<void()> func);
 
@@ -219,13 +411,78 @@ public:
     * @param prefix string on when to initiate callback
     * @param obj pointer to object to call member function on
     * @param method callback to call when string is read
-    * @note out-of-band data is only processed during a scanf call
+    * @note out-of-band data is only processed during a scanf call or by process_oob()
     */
     template <typename T, typename M>
     void oob(const char *prefix, T *obj, M method) {
         return oob(prefix, mbed::Callback<void()>(obj, method));
     }
 
+    /**
+    * Get the result of the last recv
+    *
+    * A response ends early when the device answers ERROR or -1, or when its
+    * prompt arrives before the expected lines. The error text is mapped to
+    * the closest nsapi error.
+    *
+    * @return NSAPI_ERROR_OK if the response matched, the error reported by
+    *         the device, or NSAPI_ERROR_TIMEOUT if the response was incomplete
+    */
+    nsapi_error_t get_error() const {
+        return _error;
+    }
+
+    /**
+    * Read the output sent by the device outside of a command and run the
+    * out-of-band callbacks it matches, other lines are discarded
+    *
+    * @return true if at least one out-of-band callback was called
+    */
+    bool process_oob();
+
+    /**
+    * Print the exchanges recorded since the last call, when debugging is on
+    *
+    * Exchanges are recorded in a binary log rather than printed as they
+    * happen, call this from a context that can afford the console output.
+    */
+    void print_log() {
+        _log.print();
+    }
+
+    /**
+    * Account time spent waiting for the device to the next transaction,
+    * a no-op unless AT_TRACE is enabled
+    *
+    * @param wait_us time the caller waited before it could send a command
+    */
+    void trace_queue(uint32_t wait_us) {
+#if AT_TRACE
+        _queue_us += wait_us;
+#else
+        (void)wait_us;
+#endif
+    }
+
+    /**
+    * Get the latency of the transactions per command
+    *
+    * @param stats destination for the latency of each command seen so far
+    * @param count number of entries stats can hold
+    * @return number of entries copied, 0 when AT_TRACE is not enabled
+    */
+    int get_latency(latency *stats, int count);
+
+    /**
+    * Clear the latency of all the commands
+    */
+    void reset_latency();
+
+    /**
+    * Print the latency of the transactions per command
+    */
+    void dump_latency();
+
     /**
     * Flushes the underlying stream
     */
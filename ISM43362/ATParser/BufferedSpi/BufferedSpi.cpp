@@ -21,18 +21,58 @@
  */
 
 #include "BufferedSpi.h"
+#include "SpiFrame.h"
 #include <stdarg.h>
 
 extern "C" int BufferedPrintfC(void *stream, int size, const char* format, va_list arg);
 
+// The SPI port and dataready line seen by spi_frame_read()
+struct BufferedSpi::FramePort {
+    BufferedSpi &spi;
+    Timer timer;
+
+    FramePort(BufferedSpi &spi) : spi(spi) {
+        timer.start();
+    }
+    uint16_t transfer() {
+        return (uint16_t)spi.SPI::write(0);  // dummy write to receive 2 bytes
+    }
+    bool ready() {
+        return spi.dataready.read() == 1;
+    }
+    bool ended() {
+        return spi._frame_end;
+    }
+    void wait_end(uint32_t timeout_us) {
+        uint32_t start = us_ticker_read();
+        while (!spi._frame_end && spi.dataready.read() == 1 &&
+               us_ticker_read() - start < timeout_us) {
+        }
+    }
+    bool expired() {
+        return (uint32_t)timer.read_ms() >= spi._timeout;
+    }
+    void store(char c) {
+        spi._rxbuf = c;
+    }
+};
+
 BufferedSpi::BufferedSpi(PinName mosi, PinName miso, PinName sclk, PinName nss, PinName datareadypin, uint32_t buf_size, uint32_t tx_multiple, const char* name)
     : SPI(mosi, miso, sclk, NC) , nss(nss), dataready(datareadypin), _rxbuf(buf_size), _txbuf((uint32_t)(tx_multiple*buf_size))
 {
     this->_buf_size = buf_size;
     this->_tx_multiple = tx_multiple;   
+    this->_frame_end = false;
+    this->_timeout = osWaitForever;
+    dataready.fall(callback(this, &BufferedSpi::dataready_fall));
     return;
 }
 
+void BufferedSpi::dataready_fall(void)
+{
+    _frame_end = true;
+}
+
 BufferedSpi::~BufferedSpi(void)
 {
 
@@ -61,6 +101,29 @@ void BufferedSpi::enable_nss()
     wait_ms(10);
 }
 
+bool BufferedSpi::wait_dataready(int level, uint32_t timeout_ms)
+{
+    Timer timer;
+    timer.start();
+
+    while (dataready.read() != level) {
+        if ((uint32_t)timer.read_ms() >= timeout_ms) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void BufferedSpi::set_timeout(uint32_t timeout_ms)
+{
+    _timeout = timeout_ms;
+}
+
+void BufferedSpi::attach_dataready(Callback<void()> func)
+{
+    dataready.rise(func);
+}
+
 int BufferedSpi::readable(void)
 {
     return _rxbuf.available();  // note: look if things are in the buffer
@@ -139,7 +202,8 @@ ssize_t BufferedSpi::write(const void *s, size_t length)
     this->flush_txbuf();
     
     /* wait for dataready = 1 */
-    while(dataready.read() == 0) {
+    if (!wait_dataready(1, _timeout)) {
+        return -1;
     }
     this->enable_nss();
     
@@ -173,44 +237,18 @@ ssize_t BufferedSpi::read()
 
 ssize_t BufferedSpi::read(int max)
 {
-    int len = 0;
-    int tmp;
     // TO DO : add SPI flush ! HAL_SPIEx_FlushRxFifo(&hspi);
     
-    disable_nss();
-    /* wait for data ready is up */
-    while (dataready.read() == 0) {
-        // TO DO handle the timeout
+    /* wait for data ready is up, nss is already released by the previous transfer */
+    if (!wait_dataready(1, _timeout)) {
+        return -1;
     }
     
+    FramePort port(*this);
+    _frame_end = false;
     enable_nss();
-
-    while (dataready.read() == 1) {
-        tmp = SPI::write(0);  // dummy write to receive 2 bytes
-
-        if ((tmp&0xFF00) == 0x1500) { // last char reached ?
-            wait_us(100);
-        }
-        if (dataready.read() == 0) { /* end of reception reached */
-            if ((tmp&0XFF00) == 0x1500){
-                if ((max != 0) && (len < max)) { // to remove once data > buff size is handled
-                    _rxbuf = (char)(tmp & 0xFF);
-                    len++;
-                }
-                break;
-            }
-        }
-        // TO : CHECK HOW TO HANDLE CASE WHEN number read data > buff size
-        if ((max == 0) || ((max !=0) && (len < max))) {
-            _rxbuf = (char)(tmp & 0x00FF);
-            _rxbuf = (char)((tmp >>8)& 0xFF);
-            len += 2;
-        }
-        // to put back once the above case will be handled
-        // if ((max != 0) && (len >= max)) {
-        //    break;
-        //}
-    }
+    // TO : CHECK HOW TO HANDLE CASE WHEN number read data > buff size
+    int len = spi_frame_read(port, max);
     disable_nss();
     
     return len;
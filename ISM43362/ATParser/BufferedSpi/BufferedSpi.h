@@ -80,10 +80,18 @@ private:
     void prime(void);
 
     Callback<void()> _cbs[2];
+
+    // Set by the falling edge of dataready that ends a frame
+    volatile bool _frame_end;
+    void dataready_fall(void);
+    struct FramePort;
+
+    // Longest wait for the module in write() and read()
+    uint32_t _timeout;
     
 public:
     MyBuffer <char> _rxbuf;
-    DigitalIn dataready;
+    InterruptIn dataready;
     enum IrqType {
         RxIrq = 0,
         TxIrq,
@@ -122,6 +130,23 @@ public:
     virtual void enable_nss(void);
     
     virtual void disable_nss(void);
+
+    /** Wait until the dataready line reaches a level
+     *  @param level Expected level of the dataready line
+     *  @param timeout_ms Maximum time to wait in milliseconds
+     *  @return true if the level was reached before the timeout
+     */
+    virtual bool wait_dataready(int level, uint32_t timeout_ms);
+
+    /** Set the longest time write() and read() wait for the module
+     *  @param timeout_ms Maximum time in milliseconds, osWaitForever by default
+     */
+    virtual void set_timeout(uint32_t timeout_ms);
+
+    /** Attach a function to call when the dataready line rises
+     *  @param func Function called in interrupt context, or NULL to detach
+     */
+    virtual void attach_dataready(Callback<void()> func);
     
     /** Check on how many bytes are in the rx buffer
      *  @return 1 if something exists, 0 otherwise
@@ -161,13 +186,16 @@ public:
     /** Write data to the Buffered Spi Port
      *  @param s A pointer to data to send
      *  @param length The amount of data being pointed to
-     *  @return The number of bytes written to the Spi Port Buffer
+     *  @return The number of bytes written to the Spi Port Buffer, -1 if
+     *          the module was not ready within the timeout
      */
     virtual ssize_t write(const void *s, std::size_t length);
     
     /** Read data from the Spi Port to the _rxbuf
      *  @param max: optional. = max sieze of the input read
-     *  @return The number of bytes read from the SPI port and written to the _rxbuf
+     *  @return The number of bytes read from the SPI port and written to the _rxbuf,
+     *          0 if the module only sent padding, -1 if the module did not get
+     *          ready or the frame was cut at the timeout, its bytes are kept
      */
     virtual ssize_t read();
     virtual ssize_t read(int max);
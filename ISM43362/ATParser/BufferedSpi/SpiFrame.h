@@ -0,0 +1,120 @@
+/**
+ * @file    SpiFrame.h
+ * @brief   Decoding of the frames the ISM43362 module sends over SPI
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SPIFRAME_H
+#define SPIFRAME_H
+
+#include <stdint.h>
+
+/* Padding byte of the frames sent by the module */
+#define SPI_PADDING         0x15
+#define SPI_PADDING_WORD    ((SPI_PADDING << 8) | SPI_PADDING)
+
+/* Maximum time between the prompt ending a frame and the fall of dataready,
+ * past it the prompt was part of the data
+ */
+#ifndef BUFFEREDSPI_FRAME_END_TIMEOUT
+#define BUFFEREDSPI_FRAME_END_TIMEOUT 100 /* microseconds */
+#endif
+
+/* Number of halfwords read between two checks of the timeout, and of
+ * padding halfwords after which the module is taken as idle
+ */
+#define BUFFEREDSPI_TIMEOUT_CHECK 64
+
+/* Whether a halfword completes the "\r\n> " prompt ending the frames, the
+ * halfwords are little endian and odd frames are padded
+ */
+inline bool spi_frame_prompt(uint16_t prev, uint16_t word)
+{
+    return (prev == 0x0A0D && word == 0x203E) ||
+           (prev == 0x3E0A && word == ((SPI_PADDING << 8) | ' '));
+}
+
+/* Number of bytes of a halfword that are data, only the last halfword of a
+ * frame is padded
+ */
+inline int spi_frame_bytes(uint16_t word, bool last)
+{
+    if (!last || (word >> 8) != SPI_PADDING) {
+        return 2;
+    }
+    return ((word & 0xFF) == SPI_PADDING) ? 0 : 1;
+}
+
+/* Read one frame through port, which provides:
+ *   uint16_t transfer()      clock one halfword out of the module
+ *   bool ready()             dataready is high
+ *   bool ended()             dataready fell since the frame started
+ *   void wait_end(us)        wait up to us for the frame to end
+ *   bool expired()           the read timeout has elapsed
+ *   void store(char c)       keep a byte of the frame
+ *
+ * Stores at most max bytes, 0 for no limit. Returns the number of bytes
+ * stored, 0 if the module only sent padding, or -1 if the frame was cut
+ * at the timeout, its bytes are stored anyway.
+ */
+template <typename Port>
+int spi_frame_read(Port &port, int max)
+{
+    int len = 0;
+    uint16_t prev = 0;
+    bool data = false;
+
+    for (int words = 1; !port.ended() && port.ready(); words++) {
+        /* A frame that never ends is cut at the timeout */
+        if ((words % BUFFEREDSPI_TIMEOUT_CHECK) == 0 && port.expired()) {
+            return -1;
+        }
+        uint16_t word = port.transfer();
+
+        /* A module with nothing to send only clocks out padding */
+        if (!data && word == SPI_PADDING_WORD) {
+            if (words >= BUFFEREDSPI_TIMEOUT_CHECK) {
+                break;
+            }
+            continue;
+        }
+        data = true;
+
+        /* The prompt may also be part of the data, the frame only ends if
+         * dataready falls right after it
+         */
+        if (spi_frame_prompt(prev, word)) {
+            port.wait_end(BUFFEREDSPI_FRAME_END_TIMEOUT);
+        }
+        bool last = port.ended() || !port.ready();
+        prev = word;
+
+        int count = spi_frame_bytes(word, last);
+        if (count > 0 && ((max == 0) || (len < max))) {
+            port.store((char)(word & 0xFF));
+            len++;
+        }
+        if (count > 1 && ((max == 0) || (len < max))) {
+            port.store((char)(word >> 8));
+            len++;
+        }
+
+        if (last) {
+            break;
+        }
+    }
+    return len;
+}
+
+#endif
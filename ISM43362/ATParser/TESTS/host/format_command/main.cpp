@@ -0,0 +1,146 @@
+/* Host test and benchmark of format_command()
+ *
+ * Checks the commands against snprintf, the bounds of the buffer, and times
+ * the formatting of typical commands against vsprintf. Build and run on the
+ * host:
+ *
+ *   g++ -O2 -Wall -Wextra -I../../.. main.cpp ../../../ATFormat.cpp -o format_command && ./format_command
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "ATFormat.h"
+
+#define BENCH_ITERATIONS 1000000
+
+static int failures = 0;
+
+static int format(char *buffer, int size, const char *fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    int len = format_command(buffer, size, fmt, args);
+    va_end(args);
+    return len;
+}
+
+static int reference(char *buffer, const char *fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    int len = vsprintf(buffer, fmt, args);
+    va_end(args);
+    return len;
+}
+
+// Same output as snprintf for a command that fits
+#define EXPECT_SAME(...) do { \
+    char out[128], ref[128]; \
+    int len = format(out, sizeof(out), __VA_ARGS__); \
+    snprintf(ref, sizeof(ref), __VA_ARGS__); \
+    if (len < 0 || (size_t)len != strlen(ref) || memcmp(out, ref, len) != 0) { \
+        printf("%s:%d: %s gave \"%.*s\", expected \"%s\"\n", __FILE__, __LINE__, \
+               #__VA_ARGS__, len < 0 ? 0 : len, out, ref); \
+        failures++; \
+    } \
+} while (0)
+
+#define EXPECT(cond) do { \
+    if (!(cond)) { \
+        printf("%s:%d: expected %s\n", __FILE__, __LINE__, #cond); \
+        failures++; \
+    } \
+} while (0)
+
+static void test_conversions()
+{
+    EXPECT_SAME("C0");
+    EXPECT_SAME("P0=%d", 3);
+    EXPECT_SAME("S3=%04d\r", 17);
+    EXPECT_SAME("S3=%04d\r", 1024);
+    EXPECT_SAME("%d", -42);
+    EXPECT_SAME("%d", -2147483647 - 1);
+    EXPECT_SAME("%u", 4294967295u);
+    EXPECT_SAME("F4=%02X:%02X:%02X:%02X:%02X:%02X", 0xab, 1, 0, 255, 0x10, 0xC);
+    EXPECT_SAME("C1=%s", "my ssid");
+    EXPECT_SAME("%s=%s", "C6", "192.168.1.1");
+    EXPECT_SAME("%x%%%c", 0xbeef, 'z');
+    EXPECT_SAME("%5d|%05d", -3, -3);
+}
+
+static void test_bounds()
+{
+    char buffer[16];
+    EXPECT(format(buffer, 4, "C1=%s", "x") == 4);
+    EXPECT(format(buffer, 4, "C1=%s", "xy") == -1);
+    EXPECT(format(buffer, 4, "%04d", 12345) == -1);
+    EXPECT(format(buffer, 4, "%4d", 1) == 4);
+    EXPECT(format(buffer, 4, "%5d", 1) == -1);
+    EXPECT(format(buffer, 4, "abcde") == -1);
+    EXPECT(format(buffer, 0, "") == 0);
+    EXPECT(format(buffer, sizeof(buffer), "%f", 1.0) == -1);
+    EXPECT(format(buffer, sizeof(buffer), "%s", (const char *)NULL) == -1);
+}
+
+static void test_width_overflow()
+{
+    // Widths that overflow an int are rejected, not wrapped around
+    char buffer[16];
+    EXPECT(format(buffer, sizeof(buffer), "%4294967297d", 1) == -1);
+    EXPECT(format(buffer, sizeof(buffer), "%2147483647s", "x") == -1);
+    EXPECT(format(buffer, sizeof(buffer), "%99999999999999999999c", 'x') == -1);
+    EXPECT(format(buffer, sizeof(buffer), "%016d", 1) == 16);
+}
+
+static double elapsed_ns(clock_t start)
+{
+    return (double)(clock() - start) * 1e9 / CLOCKS_PER_SEC / BENCH_ITERATIONS;
+}
+
+// Commands as the driver sends them, the time per call is printed
+static void bench()
+{
+    char buffer[128];
+    volatile int sink = 0;
+
+    clock_t start = clock();
+    for (int i = 0; i < BENCH_ITERATIONS; i++) {
+        sink += format(buffer, sizeof(buffer), "P0=%d\rS3=%04d\r", i & 3, i & 1023);
+        sink += format(buffer, sizeof(buffer), "C1=%s\r", "my ssid");
+    }
+    double ours = elapsed_ns(start);
+
+    start = clock();
+    for (int i = 0; i < BENCH_ITERATIONS; i++) {
+        sink += reference(buffer, "P0=%d\rS3=%04d\r", i & 3, i & 1023);
+        sink += reference(buffer, "C1=%s\r", "my ssid");
+    }
+    double ref = elapsed_ns(start);
+
+    printf("format_command: %.1f ns per command pair, vsprintf: %.1f ns\n", ours, ref);
+    (void)sink;
+}
+
+int main()
+{
+    test_conversions();
+    test_bounds();
+    test_width_overflow();
+    bench();
+
+    printf("format_command: %d failures\n", failures);
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,286 @@
+/* Host test of the frame decoding of BufferedSpi::read()
+ *
+ * Runs frames built after the framing of the module through
+ * spi_frame_read(), with the dataready line replayed along with them. Build
+ * and run on the host:
+ *
+ *   g++ -Wall -Wextra -I../../../BufferedSpi main.cpp -o spi_frame && ./spi_frame
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "SpiFrame.h"
+
+// Level of dataready once a halfword has been clocked out
+enum level {
+    HIGH,       // the module has more to send
+    FALL,       // the frame ended
+    FALL_LATE,  // the frame ended, dataready falls during the wait for it
+};
+
+struct trace_word {
+    uint16_t word;
+    level after;
+};
+
+// Replays a frame, the module keeps dataready high past its end
+class TracePort {
+public:
+    TracePort(const trace_word *trace, int count, int expire_after = -1)
+        : _trace(trace), _count(count), _expire_after(expire_after),
+          _pos(0), _ended(false), _waits(0), _len(0) {
+    }
+
+    uint16_t transfer() {
+        if (_pos >= _count) {
+            return SPI_PADDING_WORD;
+        }
+        const trace_word &w = _trace[_pos++];
+        _ended = (w.after == FALL);
+        return w.word;
+    }
+    bool ready() {
+        return !_ended;
+    }
+    bool ended() {
+        return _ended;
+    }
+    void wait_end(uint32_t) {
+        _waits++;
+        if (_pos > 0 && _trace[_pos - 1].after == FALL_LATE) {
+            _ended = true;
+        }
+    }
+    bool expired() {
+        return _expire_after >= 0 && _pos >= _expire_after;
+    }
+    void store(char c) {
+        if (_len < (int)sizeof(_data)) {
+            _data[_len++] = c;
+        }
+    }
+
+    int transfers() const { return _pos; }
+    int waits() const { return _waits; }
+    int length() const { return _len; }
+    const char *data() const { return _data; }
+
+private:
+    const trace_word *_trace;
+    int _count;
+    int _expire_after;
+    int _pos;
+    bool _ended;
+    int _waits;
+    int _len;
+    char _data[512];
+};
+
+static int failures = 0;
+
+#define EXPECT(cond) do { \
+    if (!(cond)) { \
+        printf("%s:%d: %s: expected %s\n", __FILE__, __LINE__, name, #cond); \
+        failures++; \
+    } \
+} while (0)
+
+// Packs a string into little endian halfwords, padding the last one
+static int pack(const char *s, int len, trace_word *out, level last)
+{
+    int count = 0;
+    for (int i = 0; i < len; i += 2) {
+        uint8_t lo = (uint8_t)s[i];
+        uint8_t hi = (i + 1 < len) ? (uint8_t)s[i + 1] : SPI_PADDING;
+        out[count].word = (uint16_t)(lo | (hi << 8));
+        out[count].after = HIGH;
+        count++;
+    }
+    out[count - 1].after = last;
+    return count;
+}
+
+static void test_response()
+{
+    const char *name = "response";
+    static const char frame[] = "\r\nOK\r\n> ";
+    trace_word trace[16];
+    int count = pack(frame, sizeof(frame) - 1, trace, FALL_LATE);
+
+    TracePort port(trace, count);
+    int len = spi_frame_read(port, 0);
+    EXPECT(len == (int)sizeof(frame) - 1);
+    EXPECT(port.length() == len && memcmp(port.data(), frame, len) == 0);
+    EXPECT(port.transfers() == count);
+    EXPECT(port.waits() == 1);
+}
+
+static void test_odd_length()
+{
+    const char *name = "odd length";
+    static const char frame[] = "\r\n1\r\nOK\r\n> ";
+    trace_word trace[16];
+    int count = pack(frame, sizeof(frame) - 1, trace, FALL_LATE);
+    EXPECT(trace[count - 1].word == ((SPI_PADDING << 8) | ' '));
+
+    TracePort port(trace, count);
+    int len = spi_frame_read(port, 0);
+    EXPECT(len == (int)sizeof(frame) - 1);
+    EXPECT(memcmp(port.data(), frame, sizeof(frame) - 1) == 0);
+    EXPECT(port.waits() == 1);
+}
+
+static void test_prompt_in_data()
+{
+    const char *name = "prompt in data";
+    // Payload of a read (R0) that contains the prompt itself
+    static const char frame[] = "\r\nab\r\n> cd\r\nOK\r\n> ";
+    trace_word trace[16];
+    int count = pack(frame, sizeof(frame) - 1, trace, FALL_LATE);
+
+    TracePort port(trace, count);
+    int len = spi_frame_read(port, 0);
+    EXPECT(len == (int)sizeof(frame) - 1);
+    EXPECT(memcmp(port.data(), frame, sizeof(frame) - 1) == 0);
+    EXPECT(port.transfers() == count);
+    // Both prompts are checked, only the last one ends the frame
+    EXPECT(port.waits() == 2);
+}
+
+static void test_only_padding()
+{
+    const char *name = "only padding";
+    trace_word trace[200];
+    for (int i = 0; i < 200; i++) {
+        trace[i].word = SPI_PADDING_WORD;
+        trace[i].after = HIGH;
+    }
+
+    TracePort port(trace, 200);
+    int len = spi_frame_read(port, 0);
+    EXPECT(len == 0);
+    EXPECT(port.length() == 0);
+    EXPECT(port.transfers() == BUFFEREDSPI_TIMEOUT_CHECK);
+}
+
+static void test_leading_padding()
+{
+    const char *name = "leading padding";
+    static const char frame[] = "\r\nOK\r\n> ";
+    trace_word trace[16];
+    trace[0].word = SPI_PADDING_WORD;
+    trace[0].after = HIGH;
+    trace[1].word = SPI_PADDING_WORD;
+    trace[1].after = HIGH;
+    int count = 2 + pack(frame, sizeof(frame) - 1, trace + 2, FALL_LATE);
+
+    TracePort port(trace, count);
+    int len = spi_frame_read(port, 0);
+    EXPECT(len == (int)sizeof(frame) - 1);
+    EXPECT(memcmp(port.data(), frame, sizeof(frame) - 1) == 0);
+}
+
+static void test_padding_in_data()
+{
+    const char *name = "padding in data";
+    // Binary payload holding two padding bytes in one halfword
+    static const char frame[] = "\r\n\x15\x15" "ab\r\nOK\r\n> ";
+    trace_word trace[16];
+    int count = pack(frame, sizeof(frame) - 1, trace, FALL_LATE);
+    EXPECT(trace[1].word == SPI_PADDING_WORD);
+
+    TracePort port(trace, count);
+    int len = spi_frame_read(port, 0);
+    EXPECT(len == (int)sizeof(frame) - 1);
+    EXPECT(memcmp(port.data(), frame, sizeof(frame) - 1) == 0);
+}
+
+static void test_padded_end()
+{
+    const char *name = "padded end";
+    // Dataready falls on a halfword of padding after the prompt
+    static const char frame[] = "\r\nOK\r\n> ";
+    trace_word trace[16];
+    int count = pack(frame, sizeof(frame) - 1, trace, HIGH);
+    trace[count].word = SPI_PADDING_WORD;
+    trace[count].after = FALL;
+    count++;
+
+    TracePort port(trace, count);
+    int len = spi_frame_read(port, 0);
+    EXPECT(len == (int)sizeof(frame) - 1);
+    EXPECT(port.transfers() == count);
+}
+
+static void test_cut()
+{
+    const char *name = "cut";
+    trace_word trace[300];
+    for (int i = 0; i < 300; i++) {
+        trace[i].word = 0x6261;  // "ab"
+        trace[i].after = HIGH;
+    }
+
+    // The timeout is only checked every BUFFEREDSPI_TIMEOUT_CHECK halfwords
+    TracePort port(trace, 300, 100);
+    int len = spi_frame_read(port, 0);
+    EXPECT(len == -1);
+    EXPECT(port.transfers() == 2 * BUFFEREDSPI_TIMEOUT_CHECK - 1);
+    EXPECT(port.length() == 2 * port.transfers());
+}
+
+static void test_max()
+{
+    const char *name = "max";
+    static const char frame[] = "\r\nOK\r\n> ";
+    trace_word trace[16];
+    int count = pack(frame, sizeof(frame) - 1, trace, FALL_LATE);
+
+    // The rest of the frame is read and dropped
+    TracePort port(trace, count);
+    int len = spi_frame_read(port, 3);
+    EXPECT(len == 3);
+    EXPECT(port.length() == 3 && memcmp(port.data(), frame, 3) == 0);
+    EXPECT(port.transfers() == count);
+}
+
+static void test_helpers()
+{
+    const char *name = "helpers";
+    EXPECT(spi_frame_prompt(0x0A0D, 0x203E));
+    EXPECT(spi_frame_prompt(0x3E0A, 0x1520));
+    EXPECT(!spi_frame_prompt(0x0A0D, 0x1520));
+    EXPECT(spi_frame_bytes(SPI_PADDING_WORD, false) == 2);
+    EXPECT(spi_frame_bytes(SPI_PADDING_WORD, true) == 0);
+    EXPECT(spi_frame_bytes(0x1520, true) == 1);
+    EXPECT(spi_frame_bytes(0x2015, true) == 2);
+}
+
+int main()
+{
+    test_helpers();
+    test_response();
+    test_odd_length();
+    test_prompt_in_data();
+    test_only_padding();
+    test_leading_padding();
+    test_padding_in_data();
+    test_padded_end();
+    test_cut();
+    test_max();
+
+    printf("spi_frame: %d failures\n", failures);
+    return failures ? 1 : 0;
+}
@@ -17,44 +17,85 @@
 
 #include "ISM43362.h"
 
-ISM43362::ISM43362(PinName mosi, PinName miso, PinName sclk, PinName nss, PinName resetpin, PinName datareadypin, PinName wakeup, bool debug)
-    : _bufferspi(mosi, miso, sclk, nss, datareadypin), _parser(_bufferspi), _resetpin(resetpin),
-      _packets(0), _packets_end(&_packets)
+/* Constant commands, sent from flash as they are */
+static const ATParser::frame cmd_version = ES_WIFI_COMMAND("I?");
+static const ATParser::frame cmd_join = ES_WIFI_COMMAND("C0");
+static const ATParser::frame cmd_leave = ES_WIFI_COMMAND("CD");
+static const ATParser::frame cmd_status = ES_WIFI_COMMAND("C?");
+static const ATParser::frame cmd_rssi = ES_WIFI_COMMAND("CR");
+static const ATParser::frame cmd_mac = ES_WIFI_COMMAND("Z5");
+static const ATParser::frame cmd_scan = ES_WIFI_COMMAND("F0");
+static const ATParser::frame cmd_client_start = ES_WIFI_COMMAND("P6=1");
+static const ATParser::frame cmd_client_stop = ES_WIFI_COMMAND("P7=0");
+static const ATParser::frame cmd_server_start = ES_WIFI_COMMAND("P5=1");
+static const ATParser::frame cmd_server_stop = ES_WIFI_COMMAND("P5=0");
+static const ATParser::frame cmd_socket_info = ES_WIFI_COMMAND("P?");
+static const ATParser::frame cmd_read = ES_WIFI_COMMAND("R0");
+
+/* Longest arguments of the commands taking one: a decimal int, a WPA
+ * passphrase, a dotted IPv4 address and a hostname
+ */
+#define ES_WIFI_INT_WIDTH           11
+#define ES_WIFI_PASSPHRASE_WIDTH    64
+#define ES_WIFI_IP_WIDTH            15
+#define ES_WIFI_HOSTNAME_WIDTH      253
+
+/* Declares a command taking one argument of up to width characters, the
+ * command with its longest argument must fit in the parser buffer
+ */
+#define ES_WIFI_PREFIX(name, command, width) \
+    MBED_STATIC_ASSERT(sizeof(command) - 1 + (width) + sizeof(ES_WIFI_DELIMITER) - 1 <= ES_WIFI_SPI_BUFFER_SIZE, \
+                       "command " command " does not fit in the parser buffer"); \
+    static const ATParser::frame name = AT_PREFIX(command)
+
+/* Commands taking one argument, checked by the transact() overloads */
+ES_WIFI_PREFIX(cmd_ssid, "C1=", ES_WIFI_MAX_SSID_NAME_SIZE);
+ES_WIFI_PREFIX(cmd_passphrase, "C2=", ES_WIFI_PASSPHRASE_WIDTH);
+ES_WIFI_PREFIX(cmd_security, "C3=", ES_WIFI_INT_WIDTH);
+ES_WIFI_PREFIX(cmd_dhcp, "C4=", ES_WIFI_INT_WIDTH);
+ES_WIFI_PREFIX(cmd_ip, "C6=", ES_WIFI_IP_WIDTH);
+ES_WIFI_PREFIX(cmd_netmask, "C7=", ES_WIFI_IP_WIDTH);
+ES_WIFI_PREFIX(cmd_gateway, "C8=", ES_WIFI_IP_WIDTH);
+ES_WIFI_PREFIX(cmd_dns_primary, "C9=", ES_WIFI_IP_WIDTH);
+ES_WIFI_PREFIX(cmd_dns_secondary, "CA=", ES_WIFI_IP_WIDTH);
+ES_WIFI_PREFIX(cmd_autoconnect, "CE=", ES_WIFI_INT_WIDTH);
+ES_WIFI_PREFIX(cmd_lookup, "D0=", ES_WIFI_HOSTNAME_WIDTH);
+ES_WIFI_PREFIX(cmd_channel, "F3=", ES_WIFI_INT_WIDTH);
+ES_WIFI_PREFIX(cmd_socket, "P0=", ES_WIFI_INT_WIDTH);
+ES_WIFI_PREFIX(cmd_protocol, "P1=", ES_WIFI_INT_WIDTH);
+ES_WIFI_PREFIX(cmd_local_port, "P2=", ES_WIFI_INT_WIDTH);
+ES_WIFI_PREFIX(cmd_remote_ip, "P3=", ES_WIFI_IP_WIDTH);
+ES_WIFI_PREFIX(cmd_remote_port, "P4=", ES_WIFI_INT_WIDTH);
+ES_WIFI_PREFIX(cmd_read_size, "R1=", ES_WIFI_INT_WIDTH);
+ES_WIFI_PREFIX(cmd_read_timeout, "R2=", ES_WIFI_INT_WIDTH);
+ES_WIFI_PREFIX(cmd_write_timeout, "S2=", ES_WIFI_INT_WIDTH);
+
+/* Scan filters matching any access point */
+static const uint8_t any_bssid[ES_WIFI_BSSID_SIZE] = {0};
+
+ISM43362::ISM43362(PinName mosi, PinName miso, PinName sclk, PinName nss, PinName resetpin, PinName datareadypin, PinName wakeup, bool debug, bool boot)
+    : _bufferspi(mosi, miso, sclk, nss, datareadypin, ES_WIFI_SPI_BUFFER_SIZE, 1),
+      _parser(_bufferspi, ES_WIFI_DELIMITER, ES_WIFI_SPI_BUFFER_SIZE), _resetpin(resetpin),
+      _boot_time(-1), _write_timeout(-1), _owners(0), _released(0), _latched(false), _async(false), _packets(0), _packets_end(&_packets)
 {
-    Timer timer;
-    uint16_t Prompt[3];
-    uint8_t count = 0;
-    
     DigitalOut wakeup_pin(wakeup);
-    ISM43362::setTimeout((uint32_t)500);
+    _timeouts[ISM43362_TIMEOUT_CONNECT] = ISM43362_CONNECT_TIMEOUT;
+    _timeouts[ISM43362_TIMEOUT_SCAN] = ISM43362_SCAN_TIMEOUT;
+    _timeouts[ISM43362_TIMEOUT_DNS] = ISM43362_DNS_TIMEOUT;
+    _timeouts[ISM43362_TIMEOUT_SEND] = ISM43362_SEND_TIMEOUT;
+    _timeouts[ISM43362_TIMEOUT_RECV] = ISM43362_RECV_TIMEOUT;
+    _timeouts[ISM43362_TIMEOUT_MISC] = ISM43362_MISC_TIMEOUT;
+    use_timeout(ISM43362_TIMEOUT_MISC);
     _bufferspi.format(16, 0); /* 16bits, ploarity low, phase 1Edge, master mode */
     _bufferspi.frequency(10000000); /* up to 20 MHz */
 
-    _resetpin = 0;
-    wait_ms(10);
-    _resetpin = 1;
-    wait_ms(500);
-
-    _bufferspi.enable_nss();
-
-    timer.start();
-
-    while (_bufferspi.dataready.read() == 1) {
-      Prompt[count] =(uint16_t)_bufferspi.get16b();
-      count += 1;
-      if(timer.read_ms() > 0xFFFF) {
-        _bufferspi.disable_nss();
-        break;
-      }    
-    }
+    _parser.debugOn(debug);
+    _parser.oob(ES_WIFI_ASYNC_PREFIX, this, &ISM43362::_async_handler);
+    clear_settings();
 
-    if((Prompt[0] != 0x1515) ||(Prompt[1] != 0x0A0D)||
-         (Prompt[2] != 0x203E)) {
-      _bufferspi.disable_nss();
+    if (boot) {
+        reset();
     }
-    _bufferspi.disable_nss();
-    
-    _parser.debugOn(debug);
 }
 
 /**
@@ -99,10 +140,53 @@ extern "C" int32_t ParseNumber(char* ptr, uint8_t* cnt)
     return sum;                          /* Return number */
 }
 
+/**
+  * @brief  Compares a response line with a string.
+  * @param  line: response line
+  * @param  str: string to compare with
+  * @retval true if they are equal.
+  */
+static bool span_is(const ATParser::span &line, const char *str)
+{
+    return ((int)strlen(str) == line.len) && (memcmp(line.ptr, str, line.len) == 0);
+}
+
+/**
+  * @brief  Copies a comma separated field of a response line.
+  * @param  line: response line
+  * @param  index: index of the field, starting at 0
+  * @param  out: buffer receiving the null terminated field
+  * @param  size: size of the buffer
+  * @retval true if the field exists and fits in the buffer.
+  */
+static bool get_field(const ATParser::span &line, int index, char *out, int size)
+{
+    const char *ptr = line.ptr;
+    const char *end = line.ptr + line.len;
+
+    for (; index > 0; index--) {
+        const char *comma = (const char *)memchr(ptr, ',', end - ptr);
+        if (comma == NULL) {
+            return false;
+        }
+        ptr = comma + 1;
+    }
+    const char *comma = (const char *)memchr(ptr, ',', end - ptr);
+    int len = (comma ? comma : end) - ptr;
+    if (len >= size) {
+        return false;
+    }
+    memcpy(out, ptr, len);
+    out[len] = 0;
+    return true;
+}
+
 int ISM43362::get_firmware_version()
 {
-    if (!(_parser.send("I?") && _parser.recv("ISM43362-M3G-L44-SPI,C3.5.2.3.BETA9,v3.5.2,v1.4.0.rc1,v8.2.1,120000000,Inventek eS-WiFi"))){
-        printf("wrong version number\n");
+    ScopedLock<ISM43362> lock(*this);
+    use_timeout(ISM43362_TIMEOUT_MISC);
+    if (!(_parser.transact(_result, cmd_version) && (_result.count > 0) &&
+          span_is(_result.lines[0], ES_WIFI_FIRMWARE_VERSION))) {
         return -1;
     }
     return (35239);
@@ -115,155 +199,293 @@ bool ISM43362::startup(int mode)
 
 bool ISM43362::reset(void)
 {
-  
+    ScopedLock<ISM43362> lock(*this);
+    Timer timer;
+    uint16_t prompt[ES_WIFI_BOOT_PROMPT_SIZE];
+    int count = 0;
+
+    _boot_time = -1;
+    clear_settings();
+    timer.start();
+
     _resetpin = 0;
     wait_ms(10);
     _resetpin = 1;
-    wait_ms(500);
 
+    /* The module raises dataready once its boot prompt is ready to be read */
+    if (!_bufferspi.wait_dataready(1, ISM43362_BOOT_TIMEOUT)) {
+        return false;
+    }
+
+    _bufferspi.enable_nss();
+
+    while (_bufferspi.dataready.read() == 1) {
+        uint16_t word = (uint16_t)_bufferspi.get16b();
+        if (count < ES_WIFI_BOOT_PROMPT_SIZE) {
+            prompt[count] = word;
+        }
+        count++;
+        if (timer.read_ms() > ISM43362_BOOT_TIMEOUT) {
+            break;
+        }
+    }
+
+    _bufferspi.disable_nss();
+
+    if ((count != ES_WIFI_BOOT_PROMPT_SIZE) || (prompt[0] != 0x1515) ||
+        (prompt[1] != 0x0A0D) || (prompt[2] != 0x203E)) {
+        return false;
+    }
+
+    _boot_time = timer.read_ms();
     return true;
 }
 
-bool ISM43362::dhcp(bool enabled)
+int ISM43362::get_boot_time(void)
+{
+    return _boot_time;
+}
+
+void ISM43362::clear_settings(void)
 {
-    return (_parser.send("C4=%d", enabled ? 1:0) && _parser.recv("OK"));
+    memset(&_settings, 0, sizeof(_settings));
+    _settings.security = -1;
+    _settings.channel = -1;
+    _settings.autoconnect = -1;
+    _settings.dhcp = -1;
+    _settings.socket = -1;
+    _settings.read_size = -1;
+    _settings.read_timeout = -1;
+    _settings.write_timeout = -1;
+    memset(_settings.bssid, 0xFF, sizeof(_settings.bssid));
 }
 
-bool ISM43362::connect(const char *ap, const char *passPhrase)
+bool ISM43362::dhcp(bool enabled)
 {
-    if (!(_parser.send("C1=%s", ap) && (_parser.recv("OK")))) {
+    ScopedLock<ISM43362> lock(*this);
+    use_timeout(ISM43362_TIMEOUT_MISC);
+    /* The module keeps its DHCP client, and lease, across disconnects */
+    if (_settings.dhcp == (enabled ? 1 : 0)) {
+        return true;
+    }
+    if (!_parser.transact(_result, cmd_dhcp, enabled ? 1:0)) {
         return false;
     }
-    if (!(_parser.send("C2=%s", passPhrase) && (_parser.recv("OK")))) {
+    _settings.dhcp = enabled ? 1 : 0;
+    return true;
+}
+
+bool ISM43362::select_socket(int id)
+{
+    /* The module keeps the selected socket until the next P0 */
+    if (_settings.socket == id) {
+        return true;
+    }
+    if (!_parser.transact(_result, cmd_socket, id)) {
+        _settings.socket = -1;
         return false;
     }
-    /* TODO security level = 3 , is it hardcoded or not ???? */
-    if (!(_parser.send("C3=3") && (_parser.recv("OK")))) {
+    _settings.socket = id;
+    return true;
+}
+
+bool ISM43362::set_address(const ATParser::frame &cmd, char *setting, const char *addr)
+{
+    if ((addr == NULL) || (strlen(addr) >= sizeof(_settings.ip))) {
         return false;
     }
-    
-    /* now connect */
-    if (!(_parser.send("C0") && _parser.recv("OK"))) {
+    if (strcmp(setting, addr) == 0) {
+        return true;
+    }
+    if (!_parser.transact(_result, cmd, addr)) {
         return false;
     }
+    strcpy(setting, addr);
     return true;
 }
 
-bool ISM43362::disconnect(void)
+bool ISM43362::set_network(const char *ip, const char *netmask, const char *gateway)
 {
-    return _parser.send("CD") && _parser.recv("OK");
+    ScopedLock<ISM43362> lock(*this);
+    use_timeout(ISM43362_TIMEOUT_MISC);
+    return set_address(cmd_ip, _settings.ip, ip) &&
+           set_address(cmd_netmask, _settings.netmask, netmask) &&
+           set_address(cmd_gateway, _settings.gateway, gateway);
 }
 
-const char *ISM43362::getIPAddress(void)
+bool ISM43362::set_dns(const char *primary, const char *secondary)
 {
-    char tmp_ip_buffer[60];
-    char *ptr, *ptr2;
-    if (!_parser.send("C?")) {
-        return 0;
+    ScopedLock<ISM43362> lock(*this);
+    use_timeout(ISM43362_TIMEOUT_MISC);
+    if (!set_address(cmd_dns_primary, _settings.dns[0], primary)) {
+        return false;
     }
-    if (!_parser.read(tmp_ip_buffer, sizeof(tmp_ip_buffer))) {
-        printf("receivedIPAddress: %s\n", tmp_ip_buffer);
-        return 0;
+    if (secondary && !set_address(cmd_dns_secondary, _settings.dns[1], secondary)) {
+        return false;
     }
+    return true;
+}
 
-    printf("receivedIPAddress: %s\n", tmp_ip_buffer);
+bool ISM43362::connect(const char *ap, const char *passPhrase, nsapi_security_t security,
+                       uint8_t channel, const uint8_t *bssid)
+{
+    ScopedLock<ISM43362> lock(*this);
+    use_timeout(ISM43362_TIMEOUT_CONNECT);
+    int sec;
 
-    // Get the IP address in the result
-    // TODO : check if the begining of the string is always = "\r\neS-WiFi_AP_C47F51011231,"
-    ptr = strtok((char *)tmp_ip_buffer+2, ",");
-    ptr = strtok(NULL, ",");
-    ptr = strtok(NULL, ",");
-    ptr = strtok(NULL, ",");
-    ptr = strtok(NULL, ",");
-    ptr = strtok(NULL, ",");
-    ptr2 = strtok(NULL, ",");
-    if (ptr == NULL) return 0;
-    strncpy(_ip_buffer, ptr , ptr2-ptr);
+    if (!passPhrase) {
+        passPhrase = "";
+    }
 
-    return _ip_buffer;
+    switch (security) {
+        case NSAPI_SECURITY_WEP:
+            sec = ES_WIFI_SEC_WEP;
+            break;
+        case NSAPI_SECURITY_WPA:
+            sec = ES_WIFI_SEC_WPA;
+            break;
+        case NSAPI_SECURITY_WPA_WPA2:
+            sec = ES_WIFI_SEC_WPA_WPA2;
+            break;
+        case NSAPI_SECURITY_WPA2:
+            sec = ES_WIFI_SEC_WPA2;
+            break;
+        default:
+            /* Keep the historical WPA2 default when a passphrase is given */
+            sec = passPhrase[0] ? ES_WIFI_SEC_WPA2 : ES_WIFI_SEC_OPEN;
+            break;
+    }
+    if (strncmp(_settings.ssid, ap, sizeof(_settings.ssid)) != 0) {
+        if (!_parser.transact(_result, cmd_ssid, ap)) {
+            return false;
+        }
+        strncpy(_settings.ssid, ap, sizeof(_settings.ssid) - 1);
+    }
+    if (strncmp(_settings.pass, passPhrase, sizeof(_settings.pass)) != 0) {
+        if (!_parser.transact(_result, cmd_passphrase, passPhrase)) {
+            return false;
+        }
+        strncpy(_settings.pass, passPhrase, sizeof(_settings.pass) - 1);
+    }
+    if (_settings.security != sec) {
+        if (!_parser.transact(_result, cmd_security, sec)) {
+            return false;
+        }
+        _settings.security = sec;
+    }
+
+    /* Restrict the scan done by the join to a known channel/access point */
+    if (!set_scan_filters(channel, bssid)) {
+        return false;
+    }
+
+    /* now connect */
+    if (!_parser.transact(_result, cmd_join)) {
+        return false;
+    }
+    return true;
 }
 
-const char *ISM43362::getMACAddress(void)
+bool ISM43362::set_scan_filters(uint8_t channel, const uint8_t *bssid)
 {
-  char tmp_mac_buffer[30];
+    /* The filters apply to every scan of the module, F0 and joins alike */
+    if (bssid == NULL) {
+        bssid = any_bssid;
+    }
+    if (_settings.channel != channel) {
+        if (!_parser.transact(_result, cmd_channel, channel)) {
+            _settings.channel = -1;
+            return false;
+        }
+        _settings.channel = channel;
+    }
+    if (memcmp(_settings.bssid, bssid, ES_WIFI_BSSID_SIZE) != 0) {
+        if (!_parser.transact(_result, "F4=%02X:%02X:%02X:%02X:%02X:%02X", bssid[0], bssid[1], bssid[2],
+                               bssid[3], bssid[4], bssid[5])) {
+            memset(_settings.bssid, 0xFF, sizeof(_settings.bssid));
+            return false;
+        }
+        memcpy(_settings.bssid, bssid, ES_WIFI_BSSID_SIZE);
+    }
+    return true;
+}
+
+bool ISM43362::autoconnect(bool enabled)
+{
+    ScopedLock<ISM43362> lock(*this);
+    use_timeout(ISM43362_TIMEOUT_MISC);
+    if (_settings.autoconnect == (enabled ? 1 : 0)) {
+        return true;
+    }
+    if (!_parser.transact(_result, cmd_autoconnect, enabled ? 1 : 0)) {
+        return false;
+    }
+    _settings.autoconnect = enabled ? 1 : 0;
+    return true;
+}
 
-    _parser.send("Z5"); 
+bool ISM43362::disconnect(void)
+{
+    ScopedLock<ISM43362> lock(*this);
+    use_timeout(ISM43362_TIMEOUT_MISC);
+    return _parser.transact(_result, cmd_leave);
+}
 
-    if (!_parser.read(tmp_mac_buffer, sizeof(tmp_mac_buffer))) {
-        printf("receivedIPAddress: %s", tmp_mac_buffer);
+const char *ISM43362::getIPAddress(void)
+{
+    ScopedLock<ISM43362> lock(*this);
+    use_timeout(ISM43362_TIMEOUT_MISC);
+    /* <ssid>,<passphrase>,<security>,<dhcp>,<ip version>,<ip>,<netmask>,<gateway>,... */
+    if (!(_parser.transact(_result, cmd_status) && (_result.count > 0) &&
+          get_field(_result.lines[0], 5, _ip_buffer, sizeof(_ip_buffer)))) {
         return 0;
     }
-    /* Extract the MAC address from the received buffer */
-    if (!strncpy(_mac_buffer, tmp_mac_buffer+2, sizeof(_mac_buffer))) {
+    return _ip_buffer;
+}
+
+const char *ISM43362::getMACAddress(void)
+{
+    ScopedLock<ISM43362> lock(*this);
+    use_timeout(ISM43362_TIMEOUT_MISC);
+    if (!(_parser.transact(_result, cmd_mac) && (_result.count > 0) &&
+          get_field(_result.lines[0], 0, _mac_buffer, sizeof(_mac_buffer)))) {
         return 0;
     }
-
     return _mac_buffer;
 }
 
 const char *ISM43362::getGateway()
 {
-    char tmp[250];
-
-    _parser.send("C?");
-    int res = _parser.read(tmp, 250);
-    if (res <0) {
-        printf("receivedGateway: %s", tmp);
+    ScopedLock<ISM43362> lock(*this);
+    use_timeout(ISM43362_TIMEOUT_MISC);
+    if (!(_parser.transact(_result, cmd_status) && (_result.count > 0) &&
+          get_field(_result.lines[0], 7, _gateway_buffer, sizeof(_gateway_buffer)))) {
         return 0;
     }
-    /* Extract the Gateway in the received buffer */
-
-    char *ptr;
-    ptr = strtok(tmp,",");
-    for (int i = 0; i< 7;i++) {
-        if (ptr == NULL) break;
-         ptr = strtok(NULL,",");
-    }
-    
-    strncpy(_gateway_buffer, ptr, sizeof(_gateway_buffer));
-
     return _gateway_buffer;
 }
 
 const char *ISM43362::getNetmask()
 {
-    char tmp[250];
-    _parser.send("C?");
-    int res = _parser.read(tmp, 250);
-    if (res <0) {
-        printf("receivedNetmask: %s", tmp);
+    ScopedLock<ISM43362> lock(*this);
+    use_timeout(ISM43362_TIMEOUT_MISC);
+    if (!(_parser.transact(_result, cmd_status) && (_result.count > 0) &&
+          get_field(_result.lines[0], 6, _netmask_buffer, sizeof(_netmask_buffer)))) {
         return 0;
     }
-    
-    /* Extract Netmask in the received buffer */
-    char *ptr;
-    ptr = strtok(tmp,",");
-    for (int i = 0; i< 6;i++) {
-        if (ptr == NULL) break;
-         ptr = strtok(NULL,",");
-    }
-    
-    strncpy(_netmask_buffer, ptr, sizeof(_netmask_buffer));
-
     return _netmask_buffer;
 }
 
 int8_t ISM43362::getRSSI()
 {
-    int8_t rssi;
-    char tmp[25];
-    /* Read SSID */
-    if (!(_parser.send("CR"))) {
+    ScopedLock<ISM43362> lock(*this);
+    use_timeout(ISM43362_TIMEOUT_MISC);
+    char tmp[8];
+    if (!(_parser.transact(_result, cmd_rssi) && (_result.count > 0) &&
+          get_field(_result.lines[0], 0, tmp, sizeof(tmp)))) {
         return 0;
     }
-    int res = _parser.read(tmp, 25);
-    if (res <0) {
-        printf("receivedNetmask: %s", tmp);
-        return 0;
-    }
-    rssi = ParseNumber(tmp+2, NULL);
-
-    return rssi;
+    return ParseNumber(tmp, NULL);
 }
 /**
   * @brief  Parses Security type.
@@ -272,12 +494,13 @@ int8_t ISM43362::getRSSI()
   */
 extern "C" nsapi_security_t ParseSecurity(char* ptr) 
 {
+  /* Longer names first, "WPA" is part of every WPA2 one */
   if(strstr(ptr,"Open")) return NSAPI_SECURITY_NONE;
   else if(strstr(ptr,"WEP")) return NSAPI_SECURITY_WEP;
-  else if(strstr(ptr,"WPA")) return NSAPI_SECURITY_WPA;   
-  else if(strstr(ptr,"WPA2 AES")) return NSAPI_SECURITY_WPA2; 
   else if(strstr(ptr,"WPA WPA2")) return NSAPI_SECURITY_WPA_WPA2; 
+  else if(strstr(ptr,"WPA2 AES")) return NSAPI_SECURITY_WPA2; 
   else if(strstr(ptr,"WPA2 TKIP")) return NSAPI_SECURITY_UNKNOWN; // ?? no match in mbed ?   
+  else if(strstr(ptr,"WPA")) return NSAPI_SECURITY_WPA;   
   else return NSAPI_SECURITY_UNKNOWN;           
 }
 
@@ -328,137 +551,231 @@ bool ISM43362::isConnected(void)
     return getIPAddress() != 0;
 }
 
+/**
+  * @brief  Parses an access point line of a scan.
+  * @param  line: <index>,"<ssid>",<bssid>,<rssi>,<rate>,<type>,<security>,<band>,<channel>
+  * @param  ap: access point to fill
+  * @retval true if the line holds an access point.
+  */
+static bool parse_ap(const ATParser::span &line, nsapi_wifi_ap_t *ap)
+{
+    char tmp[ES_WIFI_MAX_SSID_NAME_SIZE + 3];
+    memset(ap, 0, sizeof(*ap));
+
+    if (!get_field(line, 1, tmp, sizeof(tmp))) {
+        return false;
+    }
+    int len = strlen(tmp);
+    if ((len >= 2) && (tmp[0] == '"') && (tmp[len - 1] == '"')) {
+        tmp[len - 1] = 0;
+        strncpy(ap->ssid, tmp + 1, ES_WIFI_MAX_SSID_NAME_SIZE);
+    } else {
+        strncpy(ap->ssid, tmp, ES_WIFI_MAX_SSID_NAME_SIZE);
+    }
+    if (get_field(line, 2, tmp, sizeof(tmp))) {
+        for (int j = 0; j < 6; j++) {
+            ap->bssid[j] = ParseHexNumber(tmp + (j*3), NULL);
+        }
+    }
+    if (get_field(line, 3, tmp, sizeof(tmp))) {
+        ap->rssi = ParseNumber(tmp, NULL);
+    }
+    if (get_field(line, 6, tmp, sizeof(tmp))) {
+        ap->security = ParseSecurity(tmp);
+    }
+    if (!get_field(line, 8, tmp, sizeof(tmp))) {
+        return false;
+    }
+    ap->channel = ParseNumber(tmp, NULL);
+    return true;
+}
+
 int ISM43362::scan(WiFiAccessPoint *res, unsigned limit)
 {
-    unsigned cnt = 0, num=0;
+    ScopedLock<ISM43362> lock(*this);
+    use_timeout(ISM43362_TIMEOUT_SCAN);
+    unsigned cnt = 0;
     nsapi_wifi_ap_t ap;
-    char *ptr;
-    char tmp[350];
 
-    /* Get the list of AP */
-    if (!(_parser.send("F0") && _parser.read(tmp, 350))) {
+    /* Filters left by a fast join would hide the other access points */
+    if (!set_scan_filters(0, NULL)) {
         return NSAPI_ERROR_DEVICE_ERROR;
     }
 
-    /* Parse the received buffer and fill AP buffer */
-    ptr = strtok(tmp + 2, ",");   
-  
-    while (ptr != NULL) {
-        switch (num++) { 
-        case 0: /* Ignore index */
-        case 4: /* Ignore Max Rate */
-        case 5: /* Ignore Network Type */
-        case 7: /* Ignore Radio Band */      
-            break;
-          
-        case 1:
-            ptr[strlen(ptr) - 1] = 0;
-            strncpy((char *)ap.ssid,  ptr+ 1, 32); 
-            break;
-          
-        case 2:
-            for (int i=0; i<6; i++) {
-                ap.bssid[i] = ParseHexNumber(ptr + (i*3), NULL);
-            }
-            break;
+    /* Get the list of AP */
+    if (!_parser.transact(_result, cmd_scan)) {
+        return NSAPI_ERROR_DEVICE_ERROR;
+    }
 
-        case 3: 
-            ap.rssi = ParseNumber(ptr, NULL);
-            break;
-          
-        case 6: 
-            ap.security = ParseSecurity(ptr);
-            break;      
+    /* One AP per line */
+    for (int i = 0; i < _result.count; i++) {
+        if (!parse_ap(_result.lines[i], &ap)) {
+            continue;
+        }
 
-        case 8:            
-            ap.channel = ParseNumber(ptr, NULL);
+        if (res != NULL) {
             res[cnt] = WiFiAccessPoint(ap);
-            cnt++; 
-            num = 1;
-            break;
-
-        default: 
-            break;
         }
-        ptr = strtok(NULL, ",");
+        cnt++;
         if (limit != 0 && cnt >= limit) {
             break;
         }
-    }  
+    }
 
     return cnt;
 }
 
+bool ISM43362::find_ap(const char *ssid, nsapi_wifi_ap_t *best)
+{
+    ScopedLock<ISM43362> lock(*this);
+    use_timeout(ISM43362_TIMEOUT_SCAN);
+    nsapi_wifi_ap_t ap;
+    bool found = false;
+
+    if (!set_scan_filters(0, NULL) || !_parser.transact(_result, cmd_scan)) {
+        return false;
+    }
+
+    for (int i = 0; i < _result.count; i++) {
+        if (parse_ap(_result.lines[i], &ap) && (strcmp(ap.ssid, ssid) == 0) &&
+            (!found || ap.rssi > best->rssi)) {
+            *best = ap;
+            found = true;
+        }
+    }
+    return found;
+}
+
 bool ISM43362::open(const char *type, int id, const char* addr, int port)
-{ /* TODO : This is the implementation for the client socket, need to check if need to create openserver too */
+{
+    ScopedLock<ISM43362> lock(*this);
+    use_timeout(ISM43362_TIMEOUT_MISC);
     //IDs only 0-3
-    if((id < 0) ||(id > 3)) {
-        printf("open: wrong id\n");
+    if ((id < 0) || (id > 3) || (port < 0) || (port > 65535)) {
         return false;
     }
+    memset(&_settings.remote[id], 0, sizeof(_settings.remote[id]));
     /* Set communication socket */
-    if (!(_parser.send("P0=%d", id) && _parser.recv("OK"))) {
+    if (!select_socket(id)) {
         return false;
     }
     /* Set protocol */
-    if (!(_parser.send("P1=%s", type) && _parser.recv("OK"))) {
+    if (!_parser.transact(_result, cmd_protocol, type)) {
         return false;
     }
     /* Set address */
-    if (!(_parser.send("P3=%s", addr) && _parser.recv("OK"))) {
+    if (!_parser.transact(_result, cmd_remote_ip, addr)) {
         return false;
     }
-    /* set port between 0 and 5024 */
-    if ((port < 0) ||(port > 5024)) {
-        printf("open: wrong port\n");
+    if (!_parser.transact(_result, cmd_remote_port, port)) {
         return false;
     }
-    if (!(_parser.send("P4=%d", port) && _parser.recv("OK"))) {
+    strncpy(_settings.remote[id].addr, addr, sizeof(_settings.remote[id].addr) - 1);
+    _settings.remote[id].port = port;
+    /* Start client */
+    if (!_parser.transact(_result, cmd_client_start)) {
         return false;
     }
-    /* Start client */
-    if (!_parser.send("P6=1")) { // LATER : CHECK OK !!
+    return true;
+}
+
+bool ISM43362::open_server(const char *type, int id, int port)
+{
+    ScopedLock<ISM43362> lock(*this);
+    use_timeout(ISM43362_TIMEOUT_MISC);
+    if ((id < 0) || (id > 3) || (port <= 0) || (port > 65535)) {
+        return false;
+    }
+    memset(&_settings.remote[id], 0, sizeof(_settings.remote[id]));
+    if (!select_socket(id)) {
+        return false;
+    }
+    /* Set protocol */
+    if (!_parser.transact(_result, cmd_protocol, type)) {
+        return false;
+    }
+    /* Set local port */
+    if (!_parser.transact(_result, cmd_local_port, port)) {
+        return false;
+    }
+    /* Start server */
+    if (!_parser.transact(_result, cmd_server_start)) {
         return false;
     }
-    char tmp[50];
-    _parser.recv(tmp,50);
-    printf("result of connection: %s\n", tmp);
     return true;
 }
 
 bool ISM43362::dns_lookup(const char* name, char* ip)
 {
-    char tmp[30];
-    char *ptr;
-    if (!(_parser.send("D0=%s", name) && _parser.read(tmp,30))) {
-        return 1;
+    ScopedLock<ISM43362> lock(*this);
+    use_timeout(ISM43362_TIMEOUT_DNS);
+    if (!(_parser.transact(_result, cmd_lookup, name) && (_result.count > 0) &&
+          get_field(_result.lines[0], 0, ip, NSAPI_IP_SIZE) && ip[0])) {
+        return false;
     }
-    ptr = strchr(tmp+2,'\r');
-    strncpy(ip, tmp+2, (int)(ptr - tmp - 2));
-    *(ip + (ptr - tmp - 2)) = 0;
-    printf("ip of DNSlookup: %s\n", ip);
-    return 1;
+    return true;
 }
 
 bool ISM43362::send(int id, const void *data, uint32_t amount)
 {
-    // TODO CHECK SIZE NOT > txbuf size !!! if ((amount - 2) > 
+    ScopedLock<ISM43362> lock(*this);
+    use_timeout(ISM43362_TIMEOUT_SEND);
+    return write_data(id, data, amount);
+}
+
+bool ISM43362::write_data(int id, const void *data, uint32_t amount)
+{
     /* Activate the socket id in the wifi module */
-    if ((id < 0) ||(id > 3)) {
+    if ((id < 0) ||(id > 3) || (amount > ES_WIFI_MAX_PAYLOAD_SIZE)) {
         return false;
     }
-    if (!(_parser.send("P0=%d",id) && _parser.recv("OK"))) {
+    if (!select_socket(id)) {
         return false;
     }
-    // TODO change the write timeout
+    /* Only update the write timeout when it changes */
+    if (_write_timeout >= 0 && _settings.write_timeout != _write_timeout) {
+        if (!_parser.transact(_result, cmd_write_timeout, _write_timeout)) {
+            return false;
+        }
+        _settings.write_timeout = _write_timeout;
+    }
     /* set Write Transport Packet Size */
-    if (!(_parser.send("S3=%d\r%s", (amount+2), data) && _parser.recv("OK"))){
+    if (!_parser.transact_data(_result, data, amount, "S3=%04d\r", amount)) {
         return false;
     }
 
     return true;
 }
 
+bool ISM43362::send_to(int id, const char *addr, int port, const void *data, uint32_t amount)
+{
+    ScopedLock<ISM43362> lock(*this);
+    use_timeout(ISM43362_TIMEOUT_SEND);
+    if ((id < 0) || (id > 3) || (strlen(addr) >= sizeof(_settings.remote[id].addr))) {
+        return false;
+    }
+    if (!select_socket(id)) {
+        return false;
+    }
+    /* Only change the parts of the remote endpoint that differ */
+    if (strcmp(_settings.remote[id].addr, addr) != 0) {
+        _settings.remote[id].port = 0;
+        if (!_parser.transact(_result, cmd_remote_ip, addr)) {
+            _settings.remote[id].addr[0] = 0;
+            return false;
+        }
+        strcpy(_settings.remote[id].addr, addr);
+    }
+    if (_settings.remote[id].port != port) {
+        if (!_parser.transact(_result, cmd_remote_port, port)) {
+            _settings.remote[id].port = 0;
+            return false;
+        }
+        _settings.remote[id].port = port;
+    }
+    return write_data(id, data, amount);
+}
+
 void ISM43362::_packet_handler()
 {
     int id;
@@ -489,51 +806,226 @@ void ISM43362::_packet_handler()
     _packets_end = &packet->next;
 }
 
-int32_t ISM43362::recv(int id, void *data, uint32_t amount)
+int32_t ISM43362::recv(int id, void *data, uint32_t amount, int timeout_ms)
 {
-    // TODO: check that the amount is not > rxbuff size
-    /* Activate the socket id in the wifi module */
+    ScopedLock<ISM43362> lock(*this);
+    if (timeout_ms >= 0) {
+        _parser.setTimeout(timeout_ms);
+    } else {
+        use_timeout(ISM43362_TIMEOUT_RECV);
+    }
     if ((id < 0) ||(id > 3)) {
-        return false;
+        return -1;
     }
-    if (!(_parser.send("P0=%d",id) && _parser.recv("OK"))) {
-        return false;
+    if (amount > ES_WIFI_MAX_PAYLOAD_SIZE) {
+        amount = ES_WIFI_MAX_PAYLOAD_SIZE;
+    }
+    /* Activate the socket id in the wifi module */
+    if (!select_socket(id)) {
+        return -1;
     }
-    // TODO change the recv timeout
-    if (!(_parser.send("R1=%d", amount) && _parser.recv("OK"))) {
+    if (_settings.read_timeout != ISM43362_READ_TIMEOUT) {
+        if (!_parser.transact(_result, cmd_read_timeout, ISM43362_READ_TIMEOUT)) {
+            return -1;
+        }
+        _settings.read_timeout = ISM43362_READ_TIMEOUT;
+    }
+    if (_settings.read_size != (int)amount) {
+        if (!_parser.transact(_result, cmd_read_size, amount)) {
+            return -1;
+        }
+        _settings.read_size = amount;
+    }
+
+    /* The payload is the body of the response, it may contain delimiters */
+    if (!_parser.transact(_result, cmd_read) || ((uint32_t)_result.body.len > amount)) {
+        return -1;
+    }
+    memcpy(data, _result.body.ptr, _result.body.len);
+    return _result.body.len;
+}
+
+bool ISM43362::get_remote(int id, char *addr, int *port)
+{
+    ScopedLock<ISM43362> lock(*this);
+    use_timeout(ISM43362_TIMEOUT_MISC);
+    char tmp[8];
+
+    if ((id < 0) || (id > 3)) {
         return false;
     }
-    if (!_parser.send("R0")) {
+    if (!select_socket(id)) {
         return false;
     }
 
-    _parser.read((char *)data, amount);
-    printf("socket receive: %s\n", (char *)data);
+    /* <protocol>,<local ip>,<local port>,<remote ip>,<remote port>,... */
+    if (!(_parser.transact(_result, cmd_socket_info) && (_result.count > 0) &&
+          get_field(_result.lines[0], 3, addr, 16) &&
+          get_field(_result.lines[0], 4, tmp, sizeof(tmp)))) {
+        return false;
+    }
+    *port = ParseNumber(tmp, NULL);
     return true;
 }
 
 bool ISM43362::close(int id)
 {
-    if ((id <0) || (id > 3)) {
-        printf ("Wrong socket number\n");
+    ScopedLock<ISM43362> lock(*this);
+    use_timeout(ISM43362_TIMEOUT_MISC);
+    if ((id < 0) || (id > 3)) {
         return false;
     }
     /* Set connection on this socket */
-    if (!(_parser.send("P0=%d", id) && _parser.recv("OK"))){
+    if (!select_socket(id)) {
         return false;
     }
     /* close this socket */
-    if (!(_parser.send("P7=0") && _parser.recv("OK"))){
+    if (!_parser.transact(_result, cmd_client_stop)) {
+        return false;
+    }
+    return true;
+}
+
+bool ISM43362::close_server(int id)
+{
+    ScopedLock<ISM43362> lock(*this);
+    use_timeout(ISM43362_TIMEOUT_MISC);
+    if ((id < 0) || (id > 3)) {
         return false;
     }
+    if (!select_socket(id)) {
+        return false;
+    }
+    /* stop the server on this socket */
+    if (!_parser.transact(_result, cmd_server_stop)) {
+        return false;
+    }
+    memset(&_settings.remote[id], 0, sizeof(_settings.remote[id]));
     return true;
 }
 
 void ISM43362::setTimeout(uint32_t timeout_ms)
 {
-    // TODO: send the timeout value to the wifi ?
-    _timeout = timeout_ms;
-    _parser.setTimeout(timeout_ms);
+    ScopedLock<ISM43362> lock(*this);
+    for (int i = 0; i < ISM43362_TIMEOUT_COUNT; i++) {
+        _timeouts[i] = timeout_ms;
+    }
+}
+
+void ISM43362::set_timeout(ism43362_timeout command, int timeout_ms)
+{
+    ScopedLock<ISM43362> lock(*this);
+    if ((command >= 0) && (command < ISM43362_TIMEOUT_COUNT) && (timeout_ms >= 0)) {
+        _timeouts[command] = timeout_ms;
+    }
+}
+
+int ISM43362::get_timeout(ism43362_timeout command)
+{
+    ScopedLock<ISM43362> lock(*this);
+    if ((command < 0) || (command >= ISM43362_TIMEOUT_COUNT)) {
+        return -1;
+    }
+    return _timeouts[command];
+}
+
+// Starts the budget of a command method, shared by all of its exchanges
+void ISM43362::use_timeout(ism43362_timeout command)
+{
+    int timeout = _timeouts[command];
+    /* The module itself may take the write timeout to send */
+    if (command == ISM43362_TIMEOUT_SEND && _write_timeout >= 0) {
+        timeout = max(timeout, _write_timeout + _timeouts[ISM43362_TIMEOUT_MISC]);
+    }
+    _parser.setTimeout(timeout);
+}
+
+void ISM43362::set_write_timeout(int timeout_ms)
+{
+    _write_timeout = timeout_ms;
+}
+
+void ISM43362::lock()
+{
+#if AT_TRACE
+    uint32_t start = us_ticker_read();
+    _mutex.lock();
+    if (_owners++ == 0) {
+        _parser.trace_queue(us_ticker_read() - start);
+    }
+#else
+    _mutex.lock();
+    _owners++;
+#endif
+}
+
+void ISM43362::unlock()
+{
+    /* The last transaction read whatever the module had to send */
+    if (_owners == 1) {
+        _released = us_ticker_read();
+        _latched = false;
+    }
+    _owners--;
+    _mutex.unlock();
+}
+
+bool ISM43362::process_events()
+{
+    ScopedLock<ISM43362> lock(*this);
+    use_timeout(ISM43362_TIMEOUT_MISC);
+
+    /* Dataready also stays high while the module is idle, only a rise seen
+     * since the last transaction means that output is pending
+     */
+    if (_latched) {
+        _latched = false;
+        _parser.process_oob();
+    }
+
+    bool async = _async;
+    _async = false;
+    return async;
+}
+
+int ISM43362::get_latency(ATParser::latency *stats, int count)
+{
+    ScopedLock<ISM43362> lock(*this);
+    return _parser.get_latency(stats, count);
+}
+
+void ISM43362::print_log()
+{
+    _parser.print_log();
+}
+
+void ISM43362::dump_latency()
+{
+    ScopedLock<ISM43362> lock(*this);
+    _parser.dump_latency();
+}
+
+nsapi_error_t ISM43362::get_error()
+{
+    nsapi_error_t err = _parser.get_error();
+    return err ? err : NSAPI_ERROR_DEVICE_ERROR;
+}
+
+void ISM43362::_async_handler()
+{
+    /* The message itself is discarded with the rest of its line */
+    _async = true;
+}
+
+void ISM43362::_dataready_handler()
+{
+    /* Rises during a transaction belong to its response */
+    if (!_owners && us_ticker_read() - _released > ISM43362_EVENT_HOLDOFF) {
+        _latched = true;
+        if (_event_cb) {
+            _event_cb();
+        }
+    }
 }
 
 bool ISM43362::readable()
@@ -550,7 +1042,8 @@ bool ISM43362::writeable()
 
 void ISM43362::attach(Callback<void()> func)
 {
-    /* not applicable with SPI */
+    _event_cb = func;
+    _bufferspi.attach_dataready(func ? callback(this, &ISM43362::_dataready_handler) : Callback<void()>());
 }
 
 bool ISM43362::recv_ap(nsapi_wifi_ap_t *ap)
@@ -569,11 +1062,4 @@ bool ISM43362::recv_ap(nsapi_wifi_ap_t *ap)
     return ret;
 }
 
-void ISM43362::reset_module(DigitalOut rstpin)
-{
-    rstpin = 0;
-    wait_ms(10);
-    rstpin = 1;
-    wait_ms(500);
-}
 
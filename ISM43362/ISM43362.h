@@ -26,13 +26,107 @@
 #define ES_WIFI_API_REV_SIZE                        16
 #define ES_WIFI_STACK_REV_SIZE                      16
 #define ES_WIFI_RTOS_REV_SIZE                       16
+
+/* Number of sockets of the module */
+#define ES_WIFI_SOCKET_COUNT                        4
+
+/* Largest payload of a single S3 or R0 transfer */
+#define ES_WIFI_MAX_PAYLOAD_SIZE                    1024
+
+/* Size of the SPI buffers, a full payload and its framing must fit */
+#define ES_WIFI_SPI_BUFFER_SIZE                     (ES_WIFI_MAX_PAYLOAD_SIZE + 64)
+
+/* Delimiter of the AT commands and responses */
+#define ES_WIFI_DELIMITER                           "\r\n"
+
+/* Constant command, encoded with its delimiter at compile time */
+#define ES_WIFI_COMMAND(command)                    AT_FRAME(command, ES_WIFI_DELIMITER)
+
+/* Firmware the driver was written for, as answered to I? */
+#define ES_WIFI_FIRMWARE_VERSION                    "ISM43362-M3G-L44-SPI,C3.5.2.3.BETA9,v3.5.2,v1.4.0.rc1,v8.2.1,120000000,Inventek eS-WiFi"
+
+/* Time the module waits for socket data before answering R0 */
+#ifndef ISM43362_READ_TIMEOUT
+#define ISM43362_READ_TIMEOUT 1 /* milliseconds */
+#endif
+
+/* Security types of the C3 command */
+#define ES_WIFI_SEC_OPEN                            0
+#define ES_WIFI_SEC_WEP                             1
+#define ES_WIFI_SEC_WPA                             2
+#define ES_WIFI_SEC_WPA2                            3
+#define ES_WIFI_SEC_WPA_WPA2                        4
+
+#define ES_WIFI_BSSID_SIZE                          6
+
+/* Number of 16 bit words of the boot prompt: 0x1515 0x0A0D 0x203E */
+#define ES_WIFI_BOOT_PROMPT_SIZE                    3
+
+/* Start of the asynchronous messages of the module, they end with "[EOMA]" */
+#define ES_WIFI_ASYNC_PREFIX                        "[SOMA]"
+
+/* Rises of dataready this soon after a transaction are the module getting
+ * ready for the next command, not output of its own
+ */
+#ifndef ISM43362_EVENT_HOLDOFF
+#define ISM43362_EVENT_HOLDOFF 1000 /* microseconds */
+#endif
+
+/* Maximum time between the release of reset and the boot prompt */
+#ifndef ISM43362_BOOT_TIMEOUT
+#define ISM43362_BOOT_TIMEOUT 3000 /* milliseconds */
+#endif
+
+/* Default time budget of each class of command, from sending the command
+ * to the end of its response
+ */
+#ifndef ISM43362_CONNECT_TIMEOUT
+#define ISM43362_CONNECT_TIMEOUT 15000 /* milliseconds */
+#endif
+
+#ifndef ISM43362_SCAN_TIMEOUT
+#define ISM43362_SCAN_TIMEOUT 10000 /* milliseconds */
+#endif
+
+#ifndef ISM43362_DNS_TIMEOUT
+#define ISM43362_DNS_TIMEOUT 10000 /* milliseconds */
+#endif
+
+#ifndef ISM43362_SEND_TIMEOUT
+#define ISM43362_SEND_TIMEOUT 500 /* milliseconds */
+#endif
+
+#ifndef ISM43362_RECV_TIMEOUT
+#define ISM43362_RECV_TIMEOUT 500 /* milliseconds */
+#endif
+
+#ifndef ISM43362_MISC_TIMEOUT
+#define ISM43362_MISC_TIMEOUT 500 /* milliseconds */
+#endif
+
+/* Classes of commands sharing a time budget, see ISM43362::set_timeout() */
+enum ism43362_timeout {
+    ISM43362_TIMEOUT_CONNECT = 0,   /* joining an access point */
+    ISM43362_TIMEOUT_SCAN,          /* scanning for access points */
+    ISM43362_TIMEOUT_DNS,           /* resolving a host name */
+    ISM43362_TIMEOUT_SEND,          /* sending socket data */
+    ISM43362_TIMEOUT_RECV,          /* reading socket data */
+    ISM43362_TIMEOUT_MISC,          /* every other command */
+    ISM43362_TIMEOUT_COUNT
+};
+
 /** ISM43362Interface class.
     This is an interface to a ISM43362 radio.
  */
 class ISM43362
 {
 public:
-    ISM43362(PinName mosi, PinName miso, PinName clk, PinName nss, PinName resetpin, PinName datareadypin, PinName wakeup, bool debug=false);
+    /**
+    * Constructor
+    *
+    * @param boot reset the module and wait for its prompt, when false reset() must be called before use
+    */
+    ISM43362(PinName mosi, PinName miso, PinName clk, PinName nss, PinName resetpin, PinName datareadypin, PinName wakeup, bool debug=false, bool boot=true);
     
     /**
     * Check firmware version of ISM43362
@@ -52,10 +146,20 @@ public:
     /**
     * Reset ISM43362
     *
+    * Pulses the reset line, waits for the module to raise dataready and
+    * checks the boot prompt.
+    *
     * @return true only if ISM43362 resets successfully
     */
     bool reset(void);
 
+    /**
+    * Get the duration of the last reset
+    *
+    * @return milliseconds from the reset pulse to the boot prompt, or -1 if the last reset failed
+    */
+    int get_boot_time(void);
+
     /**
     * Enable/Disable DHCP
     *
@@ -64,14 +168,49 @@ public:
     */
     bool dhcp(bool enabled);
 
+    /**
+    * Set the static IP configuration used when DHCP is disabled
+    *
+    * @param ip the IP address
+    * @param netmask the network mask
+    * @param gateway the gateway address
+    * @return true only if ISM43362 accepts the configuration
+    */
+    bool set_network(const char *ip, const char *netmask, const char *gateway);
+
+    /**
+    * Set the DNS servers used by the module
+    *
+    * @param primary the primary DNS server address
+    * @param secondary the secondary DNS server address, or null to leave it unchanged
+    * @return true only if ISM43362 accepts the configuration
+    */
+    bool set_dns(const char *primary, const char *secondary);
+
     /**
     * Connect ISM43362 to AP
     *
+    * Network settings that are already programmed in the module are not sent again.
+    *
     * @param ap the name of the AP
     * @param passPhrase the password of AP
+    * @param security type of encryption, NSAPI_SECURITY_NONE with a passphrase selects WPA2
+    * @param channel restrict the join scan to this channel, 0 for all channels
+    * @param bssid restrict the join scan to this access point, null for any
     * @return true only if ISM43362 is connected successfully
     */
-    bool connect(const char *ap, const char *passPhrase);
+    bool connect(const char *ap, const char *passPhrase, nsapi_security_t security = NSAPI_SECURITY_NONE,
+                 uint8_t channel = 0, const uint8_t *bssid = NULL);
+
+    /**
+    * Enable/Disable the module auto connect
+    *
+    * When enabled the module joins the last network again on its own after a loss of the AP.
+    *
+    * @param enabled auto connect enabled when true
+    * @return true only if ISM43362 enables/disables auto connect successfully
+    */
+    bool autoconnect(bool enabled);
 
     /**
     * Disconnect ISM43362 from AP
@@ -129,6 +268,18 @@ public:
      *               see @a nsapi_error
      */
     int scan(WiFiAccessPoint *res, unsigned limit);
+
+    /**
+    * Find the strongest access point of a network
+    *
+    * The module does not report the access point it joined, a scan for the
+    * network gives its BSSID and channel.
+    *
+    * @param ssid name of the network
+    * @param ap destination for the access point
+    * @return true only if an access point of the network was found
+    */
+    bool find_ap(const char *ssid, nsapi_wifi_ap_t *ap);
     
     /**Perform a dns query
     *
@@ -149,6 +300,18 @@ public:
     */
     bool open(const char *type, int id, const char* addr, int port);
 
+    /**
+    * Open a socket in server mode
+    *
+    * A UDP server socket can send to any peer with send_to().
+    *
+    * @param type the type of socket to open "1" for UDP or "0" for TCP
+    * @param id id to give the new socket, valid 0-3
+    * @param port local port to listen on
+    * @return true only if socket opened successfully
+    */
+    bool open_server(const char *type, int id, int port);
+
     /**
     * Sends data to an open socket
     *
@@ -159,15 +322,44 @@ public:
     */
     bool send(int id, const void *data, uint32_t amount);
 
+    /**
+    * Sends a datagram from a UDP server socket
+    *
+    * Only the remote address and port that differ from the previous
+    * datagram of the socket are programmed in the module.
+    *
+    * @param id id of socket to send from
+    * @param addr the IP address of the destination
+    * @param port the port of the destination
+    * @param data data to be sent
+    * @param amount amount of data to be sent - max 1024
+    * @return true only if data sent successfully
+    */
+    bool send_to(int id, const char *addr, int port, const void *data, uint32_t amount);
+
     /**
     * Receives data from an open socket
     *
+    * Returns what the module has buffered for the socket, waiting at most
+    * ISM43362_READ_TIMEOUT for data to arrive.
+    *
     * @param id id to receive from
     * @param data placeholder for returned information
-    * @param amount number of bytes to be received
-    * @return the number of bytes received
+    * @param amount number of bytes to be received - max ES_WIFI_MAX_PAYLOAD_SIZE
+    * @param timeout_ms time budget of the read, negative for the ISM43362_TIMEOUT_RECV one
+    * @return the number of bytes received, 0 if no data is available, negative on failure
     */
-    int32_t recv(int id, void *data, uint32_t amount);
+    int32_t recv(int id, void *data, uint32_t amount, int timeout_ms = -1);
+
+    /**
+    * Get the remote endpoint of the last data received on a socket
+    *
+    * @param id id of the socket
+    * @param addr buffer of at least 16 bytes to store the IP address
+    * @param port placeholder for the port
+    * @return true only if the endpoint was read successfully
+    */
+    bool get_remote(int id, char *addr, int *port);
 
     /**
     * Closes a socket
@@ -178,12 +370,97 @@ public:
     bool close(int id);
 
     /**
-    * Allows timeout to be changed between commands
+    * Closes a socket opened with open_server()
+    *
+    * @param id id of socket to close, valid only 0-3
+    * @return true only if socket is closed successfully
+    */
+    bool close_server(int id);
+
+    /**
+    * Set the same time budget for every class of command
     *
-    * @param timeout_ms timeout of the connection
+    * @param timeout_ms longest time a command and its response may take
     */
     void setTimeout(uint32_t timeout_ms);
 
+    /**
+    * Set the time budget of a class of command
+    *
+    * The budget covers every exchange of a call, including the waits for
+    * the module to get ready, a call past it fails with NSAPI_ERROR_TIMEOUT.
+    * A response that comes after is discarded before the next command.
+    *
+    * @param command class of command
+    * @param timeout_ms longest time a command and its response may take
+    */
+    void set_timeout(ism43362_timeout command, int timeout_ms);
+
+    /**
+    * Get the time budget of a class of command
+    *
+    * @param command class of command
+    * @return the budget in milliseconds
+    */
+    int get_timeout(ism43362_timeout command);
+
+    /**
+    * Set the time the module may take to send data, applied by the next send
+    *
+    * @param timeout_ms write transport timeout, negative to keep the module default
+    */
+    void set_write_timeout(int timeout_ms);
+
+    /**
+    * Take ownership of the module
+    *
+    * Each command is serialized on its own, hold the lock to chain
+    * commands or timeout changes into one transaction. The lock is recursive.
+    */
+    void lock();
+
+    /**
+    * Release the ownership taken with lock()
+    */
+    void unlock();
+
+    /**
+    * Read the output the module sent outside of a command and run the
+    * handlers of its out-of-band messages
+    *
+    * @return true if the module reported an asynchronous message, such as
+    *         a closed connection or a lost access point
+    */
+    bool process_events();
+
+    /**
+    * Print the commands and responses recorded while debugging is on
+    *
+    * Safe to call without the module lock, from a single context only
+    */
+    void print_log();
+
+    /**
+    * Get the latency of the commands sent to the module, see ATParser::get_latency()
+    *
+    * @param stats destination for the latency of each command
+    * @param count number of entries stats can hold
+    * @return number of entries copied, 0 unless AT_TRACE is enabled
+    */
+    int get_latency(ATParser::latency *stats, int count);
+
+    /**
+    * Print the latency of the commands sent to the module
+    */
+    void dump_latency();
+
+    /**
+    * Get the error of the last failed command
+    *
+    * @return the error reported by the module, NSAPI_ERROR_DEVICE_ERROR when it gave no reason
+    */
+    nsapi_error_t get_error();
+
     /**
     * Checks if data is available
     */
@@ -195,14 +472,15 @@ public:
     bool writeable();
 
     /**
-    * Attach a function to call whenever network state has changed
+    * Attach a function to call when the module has output to read outside
+    * of a command, process_events() must then be called from thread context
     *
-    * @param func A pointer to a void function, or 0 to set as none
+    * @param func A pointer to a void function called in interrupt context, or 0 to set as none
     */
     void attach(Callback<void()> func);
 
     /**
-    * Attach a function to call whenever network state has changed
+    * Attach a function to call when the module has output to read outside of a command
     *
     * @param obj pointer to the object to call the member function on
     * @param method pointer to the member function to call
@@ -215,9 +493,53 @@ public:
 private:
     BufferedSpi _bufferspi;
     ATParser _parser;
+    // Result of the last transaction, its spans point into the parser buffer
+    ATParser::result _result;
     DigitalOut _resetpin;
-    int _timeout;
-    void reset_module(DigitalOut rstpin);
+    int _timeouts[ISM43362_TIMEOUT_COUNT];
+    void use_timeout(ism43362_timeout command);
+    bool write_data(int id, const void *data, uint32_t amount);
+    int _boot_time;
+    int _write_timeout;
+    // Held for each whole transaction, including the socket selection (P0)
+    Mutex _mutex;
+    volatile int _owners;
+    volatile uint32_t _released;
+    // Dataready rose outside of a transaction, cleared when one completes
+    volatile bool _latched;
+    volatile bool _async;
+    Callback<void()> _event_cb;
+    void _async_handler();
+    void _dataready_handler();
+
+    // Network settings last programmed in the module, cleared on reset
+    struct {
+        char ssid[ES_WIFI_MAX_SSID_NAME_SIZE + 1];
+        // WPA passphrases have up to 64 characters
+        char pass[64 + 1];
+        int security;
+        int channel;
+        uint8_t bssid[ES_WIFI_BSSID_SIZE];
+        int autoconnect;
+        int dhcp;
+        char ip[16];
+        char netmask[16];
+        char gateway[16];
+        char dns[2][16];
+        int socket;
+        int read_size;
+        int read_timeout;
+        int write_timeout;
+        // Remote endpoint of each socket, port 0 when unknown
+        struct {
+            char addr[16];
+            int port;
+        } remote[4];
+    } _settings;
+    bool select_socket(int id);
+    bool set_scan_filters(uint8_t channel, const uint8_t *bssid);
+    bool set_address(const ATParser::frame &cmd, char *setting, const char *addr);
+    void clear_settings(void);
     struct packet {
         struct packet *next;
         int id;
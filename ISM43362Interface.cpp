@@ -18,58 +18,155 @@
 #include "ISM43362Interface.h"
 #include "mbed_debug.h"
 
-// Various timeouts for different ISM43362 operations
-#define ISM43362_CONNECT_TIMEOUT 15000 /* milliseconds */
-#define ISM43362_SEND_TIMEOUT    500   /* milliseconds */
-#define ISM43362_RECV_TIMEOUT    500   /* milliseconds */
-#define ISM43362_MISC_TIMEOUT    500   /* milliseconds */
-
 // Firmware version
 #define ISM43362_VERSION 35239 /*C3.5.2.3BETA9 */
 
+// Range of the local ports given to unbound sockets
+#define ISM43362_EPHEMERAL_PORT_MIN 49152
+#define ISM43362_EPHEMERAL_PORT_MAX 65535
+
+// Driver event flags
+#define ISM43362_FLAG_INIT_DONE 0x1
+
 // ISM43362Interface implementation
-ISM43362Interface::ISM43362Interface(PinName mosi, PinName miso, PinName sclk, PinName nss, PinName reset, PinName datareadypin, PinName wakeup, bool debug)
-    : _ism(mosi, miso, sclk, nss, reset, datareadypin, wakeup, debug)
+ISM43362Interface::ISM43362Interface(PinName mosi, PinName miso, PinName sclk, PinName nss, PinName reset, PinName datareadypin, PinName wakeup, bool debug, bool async_init)
+    : _ism(mosi, miso, sclk, nss, reset, datareadypin, wakeup, debug, !async_init),
+      _thread(osPriorityNormal, ISM43362_THREAD_STACK_SIZE), _swap_count(0), _swap_time(0),
+      _read_ahead_grows(0), _read_ahead_shrinks(0), _datagram(NULL), _datagram_owner(NULL),
+      ap_sec(NSAPI_SECURITY_NONE), ap_ch(0), _dhcp(true), _dns_count(0), _fast_reconnect(false), _fw_checked(false), _connect_time(-1), _event_pending(false),
+      _next_port(ISM43362_EPHEMERAL_PORT_MIN), _poll_id(0), _poll_interval(ISM43362_POLL_MIN_INTERVAL), _poll_time(0), _poll_next(0), _dns_ttl(ISM43362_DNS_CACHE_TTL), _dns_hits(0), _dns_misses(0),
+      _dns_queue(ISM43362_DNS_QUEUE_SIZE), _dns_thread(osPriorityNormal, ISM43362_DNS_THREAD_STACK_SIZE),
+      _log_thread(osPriorityLow, ISM43362_LOG_THREAD_STACK_SIZE)
 {
-    memset(_ids, 0, sizeof(_ids));
+    memset(ap_ssid, 0, sizeof(ap_ssid));
+    memset(ap_pass, 0, sizeof(ap_pass));
+    memset(&_last_ap, 0, sizeof(_last_ap));
+    memset(_ip, 0, sizeof(_ip));
+    memset(_netmask, 0, sizeof(_netmask));
+    memset(_gateway, 0, sizeof(_gateway));
+    memset(_dns, 0, sizeof(_dns));
+    memset(_sockets, 0, sizeof(_sockets));
+    memset(_modules, 0, sizeof(_modules));
     memset(_cbs, 0, sizeof(_cbs));
+    memset(_dns_cache, 0, sizeof(_dns_cache));
+
+    for (int i = 0; i < ISM43362_DNS_ASYNC_COUNT; i++) {
+        _dns_requests[i].in_use = false;
+        _dns_requests[i].id = 0;
+    }
+
+    _thread.start(callback(&_queue, &EventQueue::dispatch_forever));
+    _dns_thread.start(callback(&_dns_queue, &EventQueue::dispatch_forever));
 
-    _ism.attach(this, &ISM43362Interface::event); // not applicable in SPI ? to be removed ?
+    if (async_init) {
+        _queue.call(this, &ISM43362Interface::init);
+    } else {
+        _flags.set(ISM43362_FLAG_INIT_DONE);
+    }
+
+    _ism.attach(this, &ISM43362Interface::event_irq);
+
+    if (debug) {
+        _log_thread.start(callback(this, &ISM43362Interface::log_worker));
+    }
+
+#if AT_TRACE && ISM43362_TRACE_DUMP_INTERVAL
+    _queue.call_every(ISM43362_TRACE_DUMP_INTERVAL, &_ism, &ISM43362::dump_latency);
+#endif
 }
 
 int ISM43362Interface::connect(const char *ssid, const char *pass, nsapi_security_t security,
                                         uint8_t channel)
 {
-    if (channel != 0) {
-        return NSAPI_ERROR_UNSUPPORTED;
-    }
-
     set_credentials(ssid, pass, security);
+    set_channel(channel);
     return connect();
 }
 
+void ISM43362Interface::init()
+{
+    _ism.reset();
+
+    _flags.set(ISM43362_FLAG_INIT_DONE);
+}
+
+// Every path that talks to the module waits here, before it takes the
+// module lock that init() needs to reset the module
+void ISM43362Interface::wait_init()
+{
+    _flags.wait_all(ISM43362_FLAG_INIT_DONE, osWaitForever, false);
+}
+
+void ISM43362Interface::log_worker()
+{
+    for (;;) {
+        Thread::wait(ISM43362_LOG_INTERVAL);
+        _ism.print_log();
+    }
+}
+
+int ISM43362Interface::get_boot_time()
+{
+    wait_init();
+    ScopedLock<ISM43362> module(_ism);
+    return _ism.get_boot_time();
+}
+
 int ISM43362Interface::connect()
 {
-    _ism.setTimeout(ISM43362_MISC_TIMEOUT);
-    
-    if (_ism.get_firmware_version() != ISM43362_VERSION) {
-        debug("ISM43362: ERROR: Firmware incompatible with this driver.\
-               \r\nUpdate to C3.5.2.3BETA9 - https://developer.mbed.org/teams/ISM43362/wiki/Firmware-Update\r\n");  // TODO change the link
-        return NSAPI_ERROR_DEVICE_ERROR;
+    wait_init();
+    // The network configuration is guarded by the module lock, the socket
+    // state stays available during the join
+    ScopedLock<ISM43362> module(_ism);
+    Timer timer;
+    timer.start();
+
+    if (!_fw_checked) {
+        if (_ism.get_firmware_version() != ISM43362_VERSION) {
+            debug("ISM43362: ERROR: Firmware incompatible with this driver.\
+                   \r\nUpdate to C3.5.2.3BETA9 - https://developer.mbed.org/teams/ISM43362/wiki/Firmware-Update\r\n");  // TODO change the link
+            return NSAPI_ERROR_DEVICE_ERROR;
+        }
+        _fw_checked = true;
     }
-    
-    _ism.setTimeout(ISM43362_CONNECT_TIMEOUT);
 
     /* don't see the related mode in Inventek specification : remove for the moment*/
   //  if (!_ism.startup(3)) {
   //      return NSAPI_ERROR_DEVICE_ERROR;
   //  }
 
-    if (!_ism.dhcp(true)) {
+    if (!_ism.dhcp(_dhcp)) {
         return NSAPI_ERROR_DHCP_FAILURE;
     }
 
-    if (!_ism.connect(ap_ssid, ap_pass)) {
+    if (!_dhcp && !_ism.set_network(_ip, _netmask, _gateway)) {
+        return NSAPI_ERROR_PARAMETER;
+    }
+
+    if (_dns_count && !_ism.set_dns(_dns[0], (_dns_count > 1) ? _dns[1] : NULL)) {
+        return NSAPI_ERROR_PARAMETER;
+    }
+
+    if (!_ism.autoconnect(_fast_reconnect)) {
+        return NSAPI_ERROR_DEVICE_ERROR;
+    }
+
+    bool fast = _fast_reconnect && _last_ap.valid && (strcmp(_last_ap.ssid, ap_ssid) == 0);
+    bool joined = false;
+
+    if (fast) {
+        nsapi_security_t security = ap_sec;
+        if (security == NSAPI_SECURITY_NONE || security == NSAPI_SECURITY_UNKNOWN) {
+            security = _last_ap.security;
+        }
+        joined = _ism.connect(ap_ssid, ap_pass, security, ap_ch ? ap_ch : _last_ap.channel, _last_ap.bssid);
+        if (!joined) {
+            // The access point moved or went away, forget it and do a full scan
+            _last_ap.valid = false;
+        }
+    }
+
+    if (!joined && !_ism.connect(ap_ssid, ap_pass, ap_sec, ap_ch)) {
         return NSAPI_ERROR_NO_CONNECTION;
     }
 
@@ -77,11 +174,59 @@ int ISM43362Interface::connect()
         return NSAPI_ERROR_DHCP_FAILURE;
     }
 
+    // New network, previous answers may not be valid anymore
+    flush_dns_cache();
+
+    if (strcmp(_last_ap.ssid, ap_ssid) != 0) {
+        memset(&_last_ap, 0, sizeof(_last_ap));
+        strcpy(_last_ap.ssid, ap_ssid);
+        _last_ap.security = ap_sec;
+    }
+    if (ap_ch) {
+        _last_ap.channel = ap_ch;
+    }
+    _last_ap.valid = true;
+
+    // A full join does not tell which access point it picked
+    if (_fast_reconnect && !joined) {
+        _queue.call(this, &ISM43362Interface::learn_ap);
+    }
+
+    _connect_time = timer.read_ms();
     return NSAPI_ERROR_OK;
 }
 
+// Runs on the driver thread after a full join, the strongest access point
+// of the network is taken for the one the module joined
+void ISM43362Interface::learn_ap()
+{
+    nsapi_wifi_ap_t ap;
+
+    ScopedLock<ISM43362> module(_ism);
+    if (!_last_ap.ssid[0] || !_ism.find_ap(_last_ap.ssid, &ap)) {
+        return;
+    }
+
+    memcpy(_last_ap.bssid, ap.bssid, sizeof(_last_ap.bssid));
+    _last_ap.channel = ap.channel;
+    _last_ap.security = ap.security;
+    _last_ap.valid = true;
+}
+
+void ISM43362Interface::set_fast_reconnect(bool enabled)
+{
+    ScopedLock<ISM43362> module(_ism);
+    _fast_reconnect = enabled;
+}
+
+int ISM43362Interface::get_connect_time()
+{
+    return _connect_time;
+}
+
 nsapi_error_t ISM43362Interface::gethostbyname(const char *name, SocketAddress *address, nsapi_version_t version)
 {
+    wait_init();
     if (address->set_ip_address(name)) {
         if (version != NSAPI_UNSPEC && address->get_ip_version() != version) {
             return NSAPI_ERROR_DNS_FAILURE;
@@ -90,21 +235,213 @@ nsapi_error_t ISM43362Interface::gethostbyname(const char *name, SocketAddress *
         return NSAPI_ERROR_OK;
     }
     
-    char *ipbuff = new char[NSAPI_IP_SIZE];
-    int ret = 0;
-    
-    if(!_ism.dns_lookup(name, ipbuff)) {
-        ret = NSAPI_ERROR_DEVICE_ERROR;
-    } else {
-        address->set_ip_address(ipbuff);
+    _mutex.lock();
+    const char *cached = dns_cache_find(name, version);
+    if (cached) {
+        _dns_hits++;
+        address->set_ip_address(cached);
+        _mutex.unlock();
+        return NSAPI_ERROR_OK;
     }
+    _dns_misses++;
+    _mutex.unlock();
 
-    delete[] ipbuff;
-    return ret;
+    // Only the module is locked during the lookup, sockets keep working
+    char ipbuff[NSAPI_IP_SIZE];
+    _ism.lock();
+    bool found = _ism.dns_lookup(name, ipbuff);
+    _ism.unlock();
+    if (!found) {
+        return NSAPI_ERROR_DEVICE_ERROR;
+    }
+
+    if (!address->set_ip_address(ipbuff)) {
+        return NSAPI_ERROR_DNS_FAILURE;
+    }
+
+    ScopedLock<Mutex> lock(_mutex);
+    dns_cache_insert(name, version, ipbuff);
+    return NSAPI_ERROR_OK;
+}
+
+nsapi_value_or_error_t ISM43362Interface::gethostbyname_async(const char *host, NetworkStack::hostbyname_cb_t callback,
+                                                              nsapi_version_t version)
+{
+    SocketAddress address;
+
+    // Literal addresses and cached names are answered immediately
+    if (address.set_ip_address(host)) {
+        if (version != NSAPI_UNSPEC && address.get_ip_version() != version) {
+            return NSAPI_ERROR_DNS_FAILURE;
+        }
+        callback(NSAPI_ERROR_OK, &address);
+        return NSAPI_ERROR_OK;
+    }
+
+    _mutex.lock();
+    const char *cached = dns_cache_find(host, version);
+    if (cached) {
+        _dns_hits++;
+        address.set_ip_address(cached);
+        _mutex.unlock();
+        callback(NSAPI_ERROR_OK, &address);
+        return NSAPI_ERROR_OK;
+    }
+    _mutex.unlock();
+
+    if (strlen(host) >= ISM43362_DNS_NAME_SIZE) {
+        return NSAPI_ERROR_PARAMETER;
+    }
+
+    ScopedLock<Mutex> lock(_dns_mutex);
+
+    int slot = -1;
+    for (int i = 0; i < ISM43362_DNS_ASYNC_COUNT; i++) {
+        if (!_dns_requests[i].in_use) {
+            slot = i;
+            break;
+        }
+    }
+
+    if (slot == -1) {
+        return NSAPI_ERROR_NO_MEMORY;
+    }
+
+    struct dns_request *req = &_dns_requests[slot];
+    strcpy(req->name, host);
+    req->version = version;
+    req->callback = callback;
+    req->cancelled = false;
+
+    int id = _dns_queue.call(this, &ISM43362Interface::dns_async_worker, slot);
+    if (id <= 0) {
+        return NSAPI_ERROR_NO_MEMORY;
+    }
+
+    req->in_use = true;
+    req->id = id;
+    return id;
+}
+
+nsapi_error_t ISM43362Interface::gethostbyname_async_cancel(int id)
+{
+    ScopedLock<Mutex> lock(_dns_mutex);
+
+    for (int i = 0; i < ISM43362_DNS_ASYNC_COUNT; i++) {
+        struct dns_request *req = &_dns_requests[i];
+        if (req->in_use && req->id == id) {
+            // The worker skips the lookup, or drops the result if it is
+            // already running, and releases the slot
+            req->cancelled = true;
+            return NSAPI_ERROR_OK;
+        }
+    }
+
+    return NSAPI_ERROR_PARAMETER;
+}
+
+void ISM43362Interface::dns_async_worker(int slot)
+{
+    struct dns_request *req = &_dns_requests[slot];
+    SocketAddress address;
+
+    _dns_mutex.lock();
+    bool cancelled = req->cancelled;
+    _dns_mutex.unlock();
+
+    nsapi_error_t err = NSAPI_ERROR_OK;
+    if (!cancelled) {
+        err = gethostbyname(req->name, &address, req->version);
+    }
+
+    _dns_mutex.lock();
+    cancelled = req->cancelled;
+    NetworkStack::hostbyname_cb_t callback = req->callback;
+    req->callback = NetworkStack::hostbyname_cb_t();
+    req->in_use = false;
+    req->id = 0;
+    _dns_mutex.unlock();
+
+    if (!cancelled) {
+        callback(err, &address);
+    }
+}
+
+void ISM43362Interface::set_dns_cache_ttl(uint32_t ttl_ms)
+{
+    ScopedLock<Mutex> lock(_mutex);
+    _dns_ttl = ttl_ms;
+    flush_dns_cache();
+}
+
+void ISM43362Interface::flush_dns_cache()
+{
+    ScopedLock<Mutex> lock(_mutex);
+    memset(_dns_cache, 0, sizeof(_dns_cache));
+}
+
+void ISM43362Interface::get_dns_cache_stats(uint32_t *hits, uint32_t *misses)
+{
+    if (hits) {
+        *hits = _dns_hits;
+    }
+    if (misses) {
+        *misses = _dns_misses;
+    }
+}
+
+const char *ISM43362Interface::dns_cache_find(const char *name, nsapi_version_t version)
+{
+    uint64_t now = Kernel::get_ms_count();
+
+    for (int i = 0; i < ISM43362_DNS_CACHE_SIZE; i++) {
+        struct dns_entry *entry = &_dns_cache[i];
+        if (!entry->name[0] || entry->version != version || strcmp(entry->name, name) != 0) {
+            continue;
+        }
+        if (now >= entry->expires) {
+            entry->name[0] = 0;
+            return NULL;
+        }
+        entry->last_used = now;
+        return entry->ip;
+    }
+
+    return NULL;
+}
+
+void ISM43362Interface::dns_cache_insert(const char *name, nsapi_version_t version, const char *ip)
+{
+    if (_dns_ttl == 0 || strlen(name) >= ISM43362_DNS_NAME_SIZE) {
+        return;
+    }
+
+    // Reuse a free or expired slot, otherwise evict the least recently used one
+    uint64_t now = Kernel::get_ms_count();
+    struct dns_entry *victim = &_dns_cache[0];
+
+    for (int i = 0; i < ISM43362_DNS_CACHE_SIZE; i++) {
+        struct dns_entry *entry = &_dns_cache[i];
+        if (!entry->name[0] || now >= entry->expires) {
+            victim = entry;
+            break;
+        }
+        if (entry->last_used < victim->last_used) {
+            victim = entry;
+        }
+    }
+
+    strcpy(victim->name, name);
+    victim->version = version;
+    strncpy(victim->ip, ip, sizeof(victim->ip) - 1);
+    victim->ip[sizeof(victim->ip) - 1] = 0;
+    victim->expires = now + _dns_ttl;
+    victim->last_used = now;
 }
 
 int ISM43362Interface::set_credentials(const char *ssid, const char *pass, nsapi_security_t security)
 {
+    ScopedLock<ISM43362> module(_ism);
     memset(ap_ssid, 0, sizeof(ap_ssid));
     strncpy(ap_ssid, ssid, sizeof(ap_ssid));
 
@@ -113,76 +450,284 @@ int ISM43362Interface::set_credentials(const char *ssid, const char *pass, nsapi
 
     ap_sec = security;
 
+    flush_dns_cache();
+
     return 0;
 }
 
 int ISM43362Interface::set_channel(uint8_t channel)
 {
-    return NSAPI_ERROR_UNSUPPORTED;
+    ScopedLock<ISM43362> module(_ism);
+    ap_ch = channel;
+    return NSAPI_ERROR_OK;
 }
 
 int ISM43362Interface::disconnect()
 {
-    _ism.setTimeout(ISM43362_MISC_TIMEOUT);
+    wait_init();
+    ScopedLock<ISM43362> module(_ism);
 
     if (!_ism.disconnect()) {
         return NSAPI_ERROR_DEVICE_ERROR;
     }
 
+    flush_dns_cache();
+
     return NSAPI_ERROR_OK;
 }
 
 const char *ISM43362Interface::get_ip_address()
 {
+    wait_init();
+    ScopedLock<ISM43362> module(_ism);
     return _ism.getIPAddress();
 }
 
+nsapi_error_t ISM43362Interface::set_network(const char *ip_address, const char *netmask, const char *gateway)
+{
+    SocketAddress ip, mask, gw;
+
+    if (!ip.set_ip_address(ip_address) || ip.get_ip_version() != NSAPI_IPv4 ||
+        !mask.set_ip_address(netmask) || mask.get_ip_version() != NSAPI_IPv4 ||
+        !gw.set_ip_address(gateway) || gw.get_ip_version() != NSAPI_IPv4) {
+        return NSAPI_ERROR_PARAMETER;
+    }
+
+    ScopedLock<ISM43362> module(_ism);
+    strcpy(_ip, ip.get_ip_address());
+    strcpy(_netmask, mask.get_ip_address());
+    strcpy(_gateway, gw.get_ip_address());
+    _dhcp = false;
+
+    return NSAPI_ERROR_OK;
+}
+
+nsapi_error_t ISM43362Interface::set_dhcp(bool dhcp)
+{
+    ScopedLock<ISM43362> module(_ism);
+
+    if (!dhcp && !_ip[0]) {
+        return NSAPI_ERROR_PARAMETER;
+    }
+    _dhcp = dhcp;
+
+    return NSAPI_ERROR_OK;
+}
+
+nsapi_error_t ISM43362Interface::add_dns_server(const SocketAddress &address)
+{
+    if (address.get_ip_version() != NSAPI_IPv4) {
+        return NSAPI_ERROR_PARAMETER;
+    }
+
+    ScopedLock<ISM43362> module(_ism);
+    int index = (_dns_count < 2) ? _dns_count++ : 1;
+    strcpy(_dns[index], address.get_ip_address());
+
+    return NSAPI_ERROR_OK;
+}
+
 const char *ISM43362Interface::get_mac_address()
 {
+    wait_init();
+    ScopedLock<ISM43362> module(_ism);
     return _ism.getMACAddress();
 }
 
 const char *ISM43362Interface::get_gateway()
 {
+    wait_init();
+    ScopedLock<ISM43362> module(_ism);
     return _ism.getGateway();
 }
 
 const char *ISM43362Interface::get_netmask()
 {
+    wait_init();
+    ScopedLock<ISM43362> module(_ism);
     return _ism.getNetmask();
 }
 
 int8_t ISM43362Interface::get_rssi()
 {
+    wait_init();
+    ScopedLock<ISM43362> module(_ism);
     return _ism.getRSSI();
 }
 
 int ISM43362Interface::scan(WiFiAccessPoint *res, unsigned count)
 {
-    return _ism.scan(res, count);
+    wait_init();
+    ScopedLock<ISM43362> module(_ism);
+    int ret = _ism.scan(res, count);
+
+    // Remember the strongest access point of the configured network for fast reconnect
+    int best = -1;
+    for (int i = 0; res && (i < ret); i++) {
+        if (strcmp(res[i].get_ssid(), ap_ssid) == 0 &&
+            (best < 0 || res[i].get_rssi() > res[best].get_rssi())) {
+            best = i;
+        }
+    }
+
+    if (best >= 0) {
+        strcpy(_last_ap.ssid, ap_ssid);
+        memcpy(_last_ap.bssid, res[best].get_bssid(), sizeof(_last_ap.bssid));
+        _last_ap.channel = res[best].get_channel();
+        _last_ap.security = res[best].get_security();
+        _last_ap.valid = true;
+    }
+
+    return ret;
 }
 
 struct ISM43362_socket {
+    // Slot in the socket table, and module socket or -1 while parked
+    int index;
     int id;
     nsapi_protocol_t proto;
     bool connected;
     SocketAddress addr;
+    uint64_t last_used;
+    // Opened in the module's server mode, a UDP server sends to any peer
+    bool server;
+    uint16_t local_port;
+    // TCP server waiting for a client, the client takes over its module socket
+    bool listening;
+    bool accept_pending;
+    SocketAddress accept_addr;
+    // Module transport timeouts, set with ISM43362_SNDTIMEO and ISM43362_RCVTIMEO
+    int send_timeout;
+    int recv_timeout;
+    // Small TCP sends are merged until tx_deadline unless no_delay is set
+    bool no_delay;
+    uint64_t tx_deadline;
+    // Sockets of higher priority are served first by the poller
+    int priority;
+    // Size of the module reads of a TCP socket, adapted to its traffic
+    uint32_t read_size;
+    // Error of a background transfer, reported by the next call on the socket
+    nsapi_error_t error;
+    // Data drained from the module by the poller, rx_head is the oldest byte.
+    // UDP sockets store a queue of datagrams, each preceded by its header.
+    uint32_t rx_head;
+    uint32_t rx_len;
+    // The poller receives after the tail with the state unlocked
+    bool rx_busy;
+    char rx_buf[ISM43362_SOCKET_RX_SIZE];
+    // Data waiting to be sent by the poller, a single datagram for UDP
+    SocketAddress tx_addr;
+    uint32_t tx_len;
+    char tx_buf[ISM43362_SOCKET_TX_SIZE];
+};
+
+struct ISM43362_datagram {
+    uint16_t len;
+    uint16_t port;
+    char addr[NSAPI_IPv4_SIZE];
 };
 
+// Largest read requested from the module for a TCP socket
+#define ISM43362_READ_AHEAD_MAX min(ES_WIFI_MAX_PAYLOAD_SIZE, ISM43362_SOCKET_RX_SIZE)
+
+// Largest datagram read from the module, it must fit in an empty receive buffer.
+// Datagrams are stored with their actual length, as many as fit are queued.
+#define ISM43362_DATAGRAM_SIZE min(ES_WIFI_MAX_PAYLOAD_SIZE, (int)(ISM43362_SOCKET_RX_SIZE - sizeof(struct ISM43362_datagram)))
+
+static uint32_t rx_read_datagram(struct ISM43362_socket *socket, SocketAddress *addr, void *data, uint32_t size)
+{
+    struct ISM43362_datagram header;
+    memcpy(&header, socket->rx_buf, sizeof(header));
+
+    // Excess bytes of the datagram are discarded
+    uint32_t len = min(size, (uint32_t)header.len);
+    memcpy(data, &socket->rx_buf[sizeof(header)], len);
+    if (addr) {
+        addr->set_ip_address(header.addr);
+        addr->set_port(header.port);
+    }
+
+    uint32_t used = sizeof(header) + header.len;
+    socket->rx_len -= used;
+    memmove(socket->rx_buf, &socket->rx_buf[used], socket->rx_len);
+    return len;
+}
+
+static uint32_t rx_read(struct ISM43362_socket *socket, void *data, uint32_t size)
+{
+    uint32_t len = 0;
+
+    while (len < size && socket->rx_len) {
+        uint32_t chunk = ISM43362_SOCKET_RX_SIZE - socket->rx_head;
+        if (chunk > socket->rx_len) {
+            chunk = socket->rx_len;
+        }
+        if (chunk > size - len) {
+            chunk = size - len;
+        }
+        memcpy((char *)data + len, &socket->rx_buf[socket->rx_head], chunk);
+        socket->rx_head = (socket->rx_head + chunk) % ISM43362_SOCKET_RX_SIZE;
+        socket->rx_len -= chunk;
+        len += chunk;
+    }
+
+    // The head only goes back to the start when no receive is in flight,
+    // which would otherwise land past the new tail
+    if (!socket->rx_len && !socket->rx_busy) {
+        socket->rx_head = 0;
+    }
+    return len;
+}
+
+// Datagrams and full chunks are sent right away, smaller TCP
+// writes wait for more data until their deadline
+static bool tx_due(const struct ISM43362_socket *socket, uint64_t now)
+{
+    return socket->proto == NSAPI_UDP || socket->no_delay ||
+           socket->tx_len >= ISM43362_SEND_CHUNK_SIZE ||
+           socket->tx_len == ISM43362_SOCKET_TX_SIZE || now >= socket->tx_deadline;
+}
+
+static void socket_init(struct ISM43362_socket *socket, int index, nsapi_protocol_t proto)
+{
+    socket->index = index;
+    socket->id = -1;
+    socket->proto = proto;
+    socket->connected = false;
+    socket->last_used = Kernel::get_ms_count();
+    socket->server = false;
+    socket->local_port = 0;
+    socket->listening = false;
+    socket->accept_pending = false;
+    socket->no_delay = false;
+    socket->tx_deadline = 0;
+    socket->priority = 0;
+    socket->read_size = ISM43362_READ_AHEAD_MIN;
+    socket->error = NSAPI_ERROR_OK;
+    socket->rx_head = 0;
+    socket->rx_len = 0;
+    socket->rx_busy = false;
+    socket->tx_len = 0;
+}
+
 int ISM43362Interface::socket_open(void **handle, nsapi_protocol_t proto)
 {
-    // Look for an unused socket
-    int id = -1;
+    // The timeouts take the module lock, which is never taken under the state one
+    int send_timeout = _ism.get_timeout(ISM43362_TIMEOUT_SEND);
+    int recv_timeout = _ism.get_timeout(ISM43362_TIMEOUT_RECV);
+
+    ScopedLock<Mutex> lock(_mutex);
+    // Look for an unused socket, a module socket is only taken on connect
+    int index = -1;
  
     for (int i = 0; i < ISM43362_SOCKET_COUNT; i++) {
-        if (!_ids[i]) {
-            id = i;
-            _ids[i] = true;
+        if (!_sockets[i]) {
+            index = i;
             break;
         }
     }
  
-    if (id == -1) {
+    if (index == -1) {
         return NSAPI_ERROR_NO_SOCKET;
     }
     
@@ -191,109 +736,471 @@ int ISM43362Interface::socket_open(void **handle, nsapi_protocol_t proto)
         return NSAPI_ERROR_NO_SOCKET;
     }
     
-    socket->id = id;
-    socket->proto = proto;
-    socket->connected = false;
+    socket_init(socket, index, proto);
+    socket->send_timeout = send_timeout;
+    socket->recv_timeout = recv_timeout;
+    _sockets[index] = socket;
     *handle = socket;
     return 0;
 }
 
-int ISM43362Interface::socket_close(void *handle)
+int ISM43362Interface::socket_acquire(struct ISM43362_socket *socket, bool evict)
 {
-    struct ISM43362_socket *socket = (struct ISM43362_socket *)handle;
-    int err = 0;
-    _ism.setTimeout(ISM43362_MISC_TIMEOUT);
- 
-    if (socket->connected && !_ism.close(socket->id)) {
-        err = NSAPI_ERROR_DEVICE_ERROR;
+    if (socket->id >= 0) {
+        return socket->id;
     }
 
-    socket->connected = false;
-    _ids[socket->id] = false;
-    delete socket;
-    return err;
+    int id = -1;
+    for (int i = 0; i < ES_WIFI_SOCKET_COUNT; i++) {
+        if (!_modules[i]) {
+            id = i;
+            break;
+        }
+    }
+
+    if (id == -1 && evict) {
+        // Park the least recently used idle UDP socket, TCP sockets are pinned
+        struct ISM43362_socket *victim = NULL;
+        for (int i = 0; i < ES_WIFI_SOCKET_COUNT; i++) {
+            struct ISM43362_socket *s = _modules[i];
+            if (s->proto != NSAPI_UDP || s->tx_len) {
+                continue;
+            }
+            if (!victim || s->last_used < victim->last_used) {
+                victim = s;
+            }
+        }
+        if (victim) {
+            int victim_id = victim->id;
+            if (socket_park(victim)) {
+                id = victim_id;
+            }
+        }
+    }
+
+    if (id == -1) {
+        return NSAPI_ERROR_NO_SOCKET;
+    }
+
+    _modules[id] = socket;
+    socket->id = id;
+    return id;
 }
 
-int ISM43362Interface::socket_bind(void *handle, const SocketAddress &address)
+void ISM43362Interface::socket_release(struct ISM43362_socket *socket)
 {
-    return NSAPI_ERROR_UNSUPPORTED;
+    if (socket->id >= 0) {
+        _modules[socket->id] = NULL;
+        socket->id = -1;
+    }
 }
 
-int ISM43362Interface::socket_listen(void *handle, int backlog)
+bool ISM43362Interface::socket_park(struct ISM43362_socket *socket)
 {
-    return NSAPI_ERROR_UNSUPPORTED;
+    Timer timer;
+    timer.start();
+
+    // Datagrams that arrive while parked are lost, buffered ones are kept
+    bool closed = socket->server ? _ism.close_server(socket->id) : _ism.close(socket->id);
+    if (!closed) {
+        return false;
+    }
+
+    socket_release(socket);
+    _swap_count++;
+    _swap_time += timer.read_us();
+    return true;
 }
 
-int ISM43362Interface::socket_connect(void *handle, const SocketAddress &addr)
+int ISM43362Interface::socket_unpark(struct ISM43362_socket *socket, bool evict)
 {
-    struct ISM43362_socket *socket = (struct ISM43362_socket *)handle;
-    _ism.setTimeout(ISM43362_MISC_TIMEOUT);
+    Timer timer;
+    timer.start();
 
-    const char *proto = (socket->proto == NSAPI_UDP) ? "1" : "0";
-    if (!_ism.open(proto, socket->id, addr.get_ip_address(), addr.get_port())) {
-        return NSAPI_ERROR_DEVICE_ERROR;
+    if (socket_acquire(socket, evict) < 0) {
+        return NSAPI_ERROR_NO_SOCKET;
     }
-    
-    socket->connected = true;
-    return 0;
+
+    // Only UDP sockets are parked
+    bool opened = socket->server ? _ism.open_server("1", socket->id, socket->local_port) :
+                  _ism.open("1", socket->id, socket->addr.get_ip_address(), socket->addr.get_port());
+    if (!opened) {
+        socket_release(socket);
+        return _ism.get_error();
+    }
+
+    _swap_time += timer.read_us();
+    return NSAPI_ERROR_OK;
 }
-    
-int ISM43362Interface::socket_accept(void *server, void **socket, SocketAddress *addr)
+
+void ISM43362Interface::get_socket_swap_stats(uint32_t *count, uint32_t *time_us)
 {
-    return NSAPI_ERROR_UNSUPPORTED;
+    ScopedLock<Mutex> lock(_mutex);
+    if (count) {
+        *count = _swap_count;
+    }
+    if (time_us) {
+        *time_us = _swap_time;
+    }
 }
 
-int ISM43362Interface::socket_send(void *handle, const void *data, unsigned size)
+void ISM43362Interface::get_read_ahead_stats(uint32_t *grows, uint32_t *shrinks)
+{
+    ScopedLock<Mutex> lock(_mutex);
+    if (grows) {
+        *grows = _read_ahead_grows;
+    }
+    if (shrinks) {
+        *shrinks = _read_ahead_shrinks;
+    }
+}
+
+int ISM43362Interface::get_command_latency(ATParser::latency *stats, int count)
 {
+    return _ism.get_latency(stats, count);
+}
+
+int ISM43362Interface::socket_close(void *handle)
+{
+    wait_init();
+    ScopedLock<ISM43362> module(_ism);
+    ScopedLock<Mutex> lock(_mutex);
     struct ISM43362_socket *socket = (struct ISM43362_socket *)handle;
-    _ism.setTimeout(ISM43362_SEND_TIMEOUT);
- 
-    if (!_ism.send(socket->id, data, size)) {
-        return NSAPI_ERROR_DEVICE_ERROR;
+    int err = 0;
+
+    // Pending data is sent before closing
+    if (socket->connected && socket->tx_len &&
+        (socket->id >= 0 || socket_unpark(socket, true) == NSAPI_ERROR_OK)) {
+        while (socket->tx_len && flush_tx(socket)) {
+        }
     }
  
+    if (socket->connected && socket->id >= 0) {
+        bool closed = socket->server ? _ism.close_server(socket->id) : _ism.close(socket->id);
+        if (!closed) {
+            err = _ism.get_error();
+        }
+    }
+
+    socket->connected = false;
+    socket_release(socket);
+    if (_datagram_owner == socket) {
+        _datagram_owner = NULL;
+    }
+    _sockets[socket->index] = NULL;
+    _cbs[socket->index].callback = NULL;
+    _cbs[socket->index].data = NULL;
+    delete socket;
+    return err;
+}
+
+int ISM43362Interface::socket_bind(void *handle, const SocketAddress &address)
+{
+    wait_init();
+    ScopedLock<ISM43362> module(_ism);
+    ScopedLock<Mutex> lock(_mutex);
+    struct ISM43362_socket *socket = (struct ISM43362_socket *)handle;
+
+    if (socket->connected || address.get_port() == 0) {
+        return NSAPI_ERROR_PARAMETER;
+    }
+    socket->local_port = address.get_port();
+
+    // A bound UDP socket receives from any peer right away
+    if (socket->proto == NSAPI_UDP) {
+        return socket_open_server(socket);
+    }
+
+    return NSAPI_ERROR_OK;
+}
+
+int ISM43362Interface::socket_listen(void *handle, int backlog)
+{
+    wait_init();
+    ScopedLock<ISM43362> module(_ism);
+    ScopedLock<Mutex> lock(_mutex);
+    struct ISM43362_socket *socket = (struct ISM43362_socket *)handle;
+
+    if (socket->proto != NSAPI_TCP || socket->connected) {
+        return NSAPI_ERROR_PARAMETER;
+    }
+
+    // The module serves a single client per server socket, the backlog is ignored
+    (void)backlog;
+    int err = socket_open_server(socket);
+    if (err < 0) {
+        return err;
+    }
+
+    socket->listening = true;
+    return NSAPI_ERROR_OK;
+}
+
+int ISM43362Interface::socket_connect(void *handle, const SocketAddress &addr)
+{
+    wait_init();
+    ScopedLock<ISM43362> module(_ism);
+    ScopedLock<Mutex> lock(_mutex);
+    struct ISM43362_socket *socket = (struct ISM43362_socket *)handle;
+
+    if (socket_acquire(socket, true) < 0) {
+        return NSAPI_ERROR_NO_SOCKET;
+    }
+
+    const char *proto = (socket->proto == NSAPI_UDP) ? "1" : "0";
+    if (!_ism.open(proto, socket->id, addr.get_ip_address(), addr.get_port())) {
+        socket_release(socket);
+        return _ism.get_error();
+    }
+    
+    socket->connected = true;
+    socket->server = false;
+    socket->addr = addr;
+    socket->last_used = Kernel::get_ms_count();
+    poll_now();
+    return 0;
+}
+    
+int ISM43362Interface::socket_open_server(struct ISM43362_socket *socket)
+{
+    if (!socket->local_port) {
+        socket->local_port = _next_port;
+        _next_port = (_next_port == ISM43362_EPHEMERAL_PORT_MAX) ? ISM43362_EPHEMERAL_PORT_MIN : _next_port + 1;
+    }
+
+    if (socket_acquire(socket, true) < 0) {
+        return NSAPI_ERROR_NO_SOCKET;
+    }
+
+    const char *proto = (socket->proto == NSAPI_UDP) ? "1" : "0";
+    if (!_ism.open_server(proto, socket->id, socket->local_port)) {
+        socket_release(socket);
+        return _ism.get_error();
+    }
+
+    socket->connected = true;
+    socket->server = true;
+    poll_now();
+    return 0;
+}
+
+int ISM43362Interface::socket_accept(void *server, void **handle, SocketAddress *addr)
+{
+    wait_init();
+    ScopedLock<ISM43362> module(_ism);
+    ScopedLock<Mutex> lock(_mutex);
+    struct ISM43362_socket *listener = (struct ISM43362_socket *)server;
+
+    // The listener could not listen again after the previous accept
+    if (listener->error) {
+        nsapi_error_t err = listener->error;
+        listener->error = NSAPI_ERROR_OK;
+        return err;
+    }
+    if (!listener->listening) {
+        return NSAPI_ERROR_PARAMETER;
+    }
+    if (!listener->accept_pending) {
+        return NSAPI_ERROR_WOULD_BLOCK;
+    }
+
+    int index = -1;
+    for (int i = 0; i < ISM43362_SOCKET_COUNT; i++) {
+        if (!_sockets[i]) {
+            index = i;
+            break;
+        }
+    }
+    if (index == -1) {
+        return NSAPI_ERROR_NO_SOCKET;
+    }
+
+    struct ISM43362_socket *socket = new struct ISM43362_socket;
+    if (!socket) {
+        return NSAPI_ERROR_NO_SOCKET;
+    }
+
+    // The client keeps the module socket it connected to, the server
+    // listens again on another one
+    int id = listener->id;
+    socket_init(socket, index, NSAPI_TCP);
+    socket->send_timeout = _ism.get_timeout(ISM43362_TIMEOUT_SEND);
+    socket->recv_timeout = _ism.get_timeout(ISM43362_TIMEOUT_RECV);
+    socket->connected = true;
+    socket->server = true;
+    socket->local_port = listener->local_port;
+    socket->addr = listener->accept_addr;
+    socket->id = id;
+    _modules[id] = socket;
+    _sockets[index] = socket;
+
+    listener->id = -1;
+    listener->accept_pending = false;
+
+    // The accepted connection is returned anyway, the next accept reports
+    // why the listener stopped, NSAPI_ERROR_NO_SOCKET when no module socket
+    // is free
+    int err = socket_open_server(listener);
+    if (err < 0) {
+        listener->listening = false;
+        listener->connected = false;
+        listener->error = err;
+    }
+
+    if (addr) {
+        *addr = socket->addr;
+    }
+    *handle = socket;
+    return NSAPI_ERROR_OK;
+}
+
+int ISM43362Interface::socket_send(void *handle, const void *data, unsigned size)
+{
+    ScopedLock<Mutex> lock(_mutex);
+    struct ISM43362_socket *socket = (struct ISM43362_socket *)handle;
+
+    if (socket->error) {
+        nsapi_error_t err = socket->error;
+        socket->error = NSAPI_ERROR_OK;
+        return err;
+    }
+    if (!socket->connected) {
+        return NSAPI_ERROR_NO_CONNECTION;
+    }
+
+    // The data is sent by the poller, datagrams are queued one at a time
+    if (socket->proto == NSAPI_UDP) {
+        if (size > ISM43362_SOCKET_TX_SIZE || size > ES_WIFI_MAX_PAYLOAD_SIZE) {
+            return NSAPI_ERROR_PARAMETER;
+        }
+        if (socket->tx_len) {
+            return NSAPI_ERROR_WOULD_BLOCK;
+        }
+    } else {
+        if (socket->tx_len == ISM43362_SOCKET_TX_SIZE) {
+            return NSAPI_ERROR_WOULD_BLOCK;
+        }
+        size = min(size, (unsigned)(ISM43362_SOCKET_TX_SIZE - socket->tx_len));
+    }
+
+    uint64_t now = Kernel::get_ms_count();
+    if (!socket->tx_len) {
+        socket->tx_deadline = now + ISM43362_SEND_COALESCE_DELAY;
+    }
+
+    memcpy(&socket->tx_buf[socket->tx_len], data, size);
+    socket->tx_len += size;
+    socket->last_used = now;
+
+    if (tx_due(socket, now)) {
+        poll_now();
+    } else {
+        poll_in(socket->tx_deadline - now);
+    }
     return size;
 }
 
 int ISM43362Interface::socket_recv(void *handle, void *data, unsigned size)
 {
+    ScopedLock<Mutex> lock(_mutex);
     struct ISM43362_socket *socket = (struct ISM43362_socket *)handle;
-    _ism.setTimeout(ISM43362_RECV_TIMEOUT);
- 
-    int32_t recv = _ism.recv(socket->id, data, size);
-    if (recv < 0) {
-        return NSAPI_ERROR_WOULD_BLOCK;
+
+    // Only data already drained by the poller is returned
+    if (socket->rx_len) {
+        socket->last_used = Kernel::get_ms_count();
+        if (socket->proto == NSAPI_UDP) {
+            int len = rx_read_datagram(socket, NULL, data, size);
+            rx_store_datagram(socket);
+            return len;
+        }
+        return rx_read(socket, data, size);
     }
- 
-    return recv;
+    if (socket->error) {
+        nsapi_error_t err = socket->error;
+        socket->error = NSAPI_ERROR_OK;
+        return err;
+    }
+    if (!socket->connected && socket->proto == NSAPI_TCP) {
+        return NSAPI_ERROR_NO_CONNECTION;
+    }
+
+    return NSAPI_ERROR_WOULD_BLOCK;
 }
 
 int ISM43362Interface::socket_sendto(void *handle, const SocketAddress &addr, const void *data, unsigned size)
 {
     struct ISM43362_socket *socket = (struct ISM43362_socket *)handle;
 
-    if (socket->connected && socket->addr != addr) {
-        _ism.setTimeout(ISM43362_MISC_TIMEOUT);
-        if (!_ism.close(socket->id)) {
-            return NSAPI_ERROR_DEVICE_ERROR;
+    _mutex.lock();
+    bool ready = socket->connected && (socket->server || socket->addr == addr);
+    _mutex.unlock();
+
+    // Setting the socket up talks to the module, which is locked before the socket state
+    if (!ready) {
+        wait_init();
+        ScopedLock<ISM43362> module(_ism);
+        ScopedLock<Mutex> lock(_mutex);
+        int err = socket_prepare_sendto(socket, addr);
+        if (err < 0) {
+            return err;
+        }
+    }
+
+    ScopedLock<Mutex> lock(_mutex);
+    if (socket->server) {
+        if (socket->tx_len) {
+            return NSAPI_ERROR_WOULD_BLOCK;
+        }
+        socket->tx_addr = addr;
+    }
+    
+    return socket_send(socket, data, size);
+}
+
+int ISM43362Interface::socket_prepare_sendto(struct ISM43362_socket *socket, const SocketAddress &addr)
+{
+    if (socket->connected && !socket->server && socket->addr != addr) {
+        // The queued datagram must leave before the peer changes
+        if (socket->tx_len) {
+            return NSAPI_ERROR_WOULD_BLOCK;
+        }
+        if (socket->id >= 0) {
+            if (!_ism.close(socket->id)) {
+                return _ism.get_error();
+            }
+            socket_release(socket);
         }
         socket->connected = false;
     }
 
     if (!socket->connected) {
-        int err = socket_connect(socket, addr);
+        int err;
+        if (socket->proto == NSAPI_UDP) {
+            // Use the UDP server mode, so later peers only change the remote endpoint
+            err = socket_open_server(socket);
+        } else {
+            err = socket_connect(socket, addr);
+        }
         if (err < 0) {
             return err;
         }
-        socket->addr = addr;
     }
-    
-    return socket_send(socket, data, size);
+
+    return NSAPI_ERROR_OK;
 }
 
 int ISM43362Interface::socket_recvfrom(void *handle, SocketAddress *addr, void *data, unsigned size)
 {
+    ScopedLock<Mutex> lock(_mutex);
     struct ISM43362_socket *socket = (struct ISM43362_socket *)handle;
+
+    if (socket->proto == NSAPI_UDP && socket->rx_len) {
+        socket->last_used = Kernel::get_ms_count();
+        int len = rx_read_datagram(socket, addr, data, size);
+        rx_store_datagram(socket);
+        return len;
+    }
+
     int ret = socket_recv(socket, data, size);
     if (ret >= 0 && addr) {
         *addr = socket->addr;
@@ -304,15 +1211,458 @@ int ISM43362Interface::socket_recvfrom(void *handle, SocketAddress *addr, void *
 
 void ISM43362Interface::socket_attach(void *handle, void (*callback)(void *), void *data)
 {
+    ScopedLock<Mutex> lock(_mutex);
     struct ISM43362_socket *socket = (struct ISM43362_socket *)handle;    
-    _cbs[socket->id].callback = callback;
-    _cbs[socket->id].data = data;
+    _cbs[socket->index].callback = callback;
+    _cbs[socket->index].data = data;
+}
+
+nsapi_error_t ISM43362Interface::setsockopt(nsapi_socket_t handle, int level,
+                                            int optname, const void *optval, unsigned optlen)
+{
+    ScopedLock<Mutex> lock(_mutex);
+    struct ISM43362_socket *socket = (struct ISM43362_socket *)handle;
+
+    if (level != NSAPI_SOCKET) {
+        return NSAPI_ERROR_UNSUPPORTED;
+    }
+    if (!optval || optlen != sizeof(int)) {
+        return NSAPI_ERROR_PARAMETER;
+    }
+    int value = *(const int *)optval;
+
+    switch (optname) {
+        // Timeouts are applied to the module by the next transfer, and only when they differ
+        case ISM43362_SNDTIMEO:
+        case ISM43362_RCVTIMEO:
+            if (value <= 0) {
+                return NSAPI_ERROR_PARAMETER;
+            }
+            if (optname == ISM43362_SNDTIMEO) {
+                socket->send_timeout = value;
+            } else {
+                socket->recv_timeout = value;
+            }
+            return NSAPI_ERROR_OK;
+
+        case ISM43362_NODELAY:
+            socket->no_delay = (value != 0);
+            if (socket->no_delay && socket->tx_len) {
+                poll_now();
+            }
+            return NSAPI_ERROR_OK;
+
+        case ISM43362_PRIORITY:
+            socket->priority = value;
+            return NSAPI_ERROR_OK;
+
+        default:
+            return NSAPI_ERROR_UNSUPPORTED;
+    }
+}
+
+nsapi_error_t ISM43362Interface::getsockopt(nsapi_socket_t handle, int level,
+                                            int optname, void *optval, unsigned *optlen)
+{
+    ScopedLock<Mutex> lock(_mutex);
+    struct ISM43362_socket *socket = (struct ISM43362_socket *)handle;
+
+    if (level != NSAPI_SOCKET) {
+        return NSAPI_ERROR_UNSUPPORTED;
+    }
+    if (!optval || !optlen || *optlen < sizeof(int)) {
+        return NSAPI_ERROR_PARAMETER;
+    }
+
+    switch (optname) {
+        case ISM43362_SNDTIMEO:
+            *(int *)optval = socket->send_timeout;
+            break;
+        case ISM43362_RCVTIMEO:
+            *(int *)optval = socket->recv_timeout;
+            break;
+        case ISM43362_NODELAY:
+            *(int *)optval = socket->no_delay;
+            break;
+        case ISM43362_PRIORITY:
+            *(int *)optval = socket->priority;
+            break;
+        default:
+            return NSAPI_ERROR_UNSUPPORTED;
+    }
+    *optlen = sizeof(int);
+    return NSAPI_ERROR_OK;
+}
+
+void ISM43362Interface::poll_now()
+{
+    ScopedLock<Mutex> lock(_mutex);
+
+    _poll_interval = ISM43362_POLL_MIN_INTERVAL;
+    poll_in(0);
+}
+
+void ISM43362Interface::poll_in(int delay)
+{
+    ScopedLock<Mutex> lock(_mutex);
+
+    // Keep a poll that is already due earlier
+    uint64_t time = Kernel::get_ms_count() + delay;
+    if (_poll_id && _poll_time <= time) {
+        return;
+    }
+
+    if (_poll_id) {
+        _queue.cancel(_poll_id);
+    }
+    _poll_time = time;
+    _poll_id = _queue.call_in(delay, this, &ISM43362Interface::poll);
+}
+
+// Called with the module and the state locked
+bool ISM43362Interface::flush_tx(struct ISM43362_socket *socket)
+{
+    // A datagram is always sent whole
+    uint32_t len = socket->tx_len;
+    if (socket->proto != NSAPI_UDP) {
+        len = min(len, (uint32_t)ISM43362_SEND_CHUNK_SIZE);
+    }
+    bool sent;
+
+    // The module gives up first, so its error is read before the parser times out
+    _ism.set_write_timeout(socket->send_timeout);
+
+    // The socket state is released during the transfer, the sent bytes are
+    // not touched by the application meanwhile, it only appends after them
+    _mutex.unlock();
+    if (socket->server && socket->proto == NSAPI_UDP) {
+        sent = _ism.send_to(socket->id, socket->tx_addr.get_ip_address(), socket->tx_addr.get_port(),
+                            socket->tx_buf, len);
+    } else {
+        sent = _ism.send(socket->id, socket->tx_buf, len);
+    }
+    _mutex.lock();
+
+    // Only the chunk that failed is dropped, what the application queued
+    // meanwhile was already reported as sent. The error is reported by the
+    // next call.
+    socket->tx_len -= len;
+    memmove(socket->tx_buf, &socket->tx_buf[len], socket->tx_len);
+    if (!sent) {
+        socket->error = _ism.get_error();
+    }
+    return sent;
+}
+
+bool ISM43362Interface::rx_store_datagram(struct ISM43362_socket *socket)
+{
+    if (_datagram_owner != socket) {
+        return false;
+    }
+
+    struct ISM43362_datagram header;
+    memcpy(&header, _datagram, sizeof(header));
+    uint32_t used = sizeof(header) + header.len;
+    if (ISM43362_SOCKET_RX_SIZE - socket->rx_len < used) {
+        return false;
+    }
+
+    memcpy(&socket->rx_buf[socket->rx_len], _datagram, used);
+    socket->rx_len += used;
+    _datagram_owner = NULL;
+    return true;
+}
+
+bool ISM43362Interface::rx_error(struct ISM43362_socket *socket)
+{
+    // A timed out read means that no data came in, the next poll reads again
+    nsapi_error_t error = _ism.get_error();
+    if (error == NSAPI_ERROR_TIMEOUT) {
+        return false;
+    }
+
+    // A failed read is reported by the next call, a connection the peer
+    // closed is no longer polled. Only the first failure is signalled.
+    bool signal = !socket->error;
+    socket->error = error;
+    if (socket->error == NSAPI_ERROR_NO_CONNECTION && socket->proto == NSAPI_TCP) {
+        socket->connected = false;
+    }
+    return signal;
+}
+
+bool ISM43362Interface::poll_accept(struct ISM43362_socket *socket)
+{
+    char addr[NSAPI_IPv4_SIZE];
+    int port = 0;
+
+    // The module reports a remote endpoint once a client is connected
+    if (!_ism.get_remote(socket->id, addr, &port) || port == 0 ||
+        strcmp(addr, "0.0.0.0") == 0) {
+        return false;
+    }
+
+    socket->accept_addr.set_ip_address(addr);
+    socket->accept_addr.set_port(port);
+    socket->accept_pending = true;
+    return true;
+}
+
+bool ISM43362Interface::poll_rx(struct ISM43362_socket *socket)
+{
+    // The module itself only waits ISM43362_READ_TIMEOUT for data so
+    // that idle sockets do not stall the poller, the read of the socket
+    // is bounded by its own timeout
+    if (socket->proto == NSAPI_UDP) {
+        struct ISM43362_datagram header;
+        uint32_t size = ISM43362_DATAGRAM_SIZE;
+
+        // Datagrams are read whole into the scratch buffer. One that does
+        // not fit waits there until the application makes room, no other
+        // datagram is read meanwhile.
+        if (_datagram_owner) {
+            return rx_store_datagram(socket);
+        }
+        if (ISM43362_SOCKET_RX_SIZE - socket->rx_len <= sizeof(header)) {
+            return false;
+        }
+        if (!_datagram) {
+            _datagram = new char[sizeof(header) + ISM43362_DATAGRAM_SIZE];
+        }
+
+        int32_t recv = _ism.recv(socket->id, _datagram + sizeof(header), size, socket->recv_timeout);
+        if (recv < 0) {
+            return rx_error(socket);
+        }
+        if (recv == 0) {
+            return false;
+        }
+
+        // The module reports the sender of a server socket with P?, a
+        // connected socket only receives from its peer
+        memset(&header, 0, sizeof(header));
+        header.len = recv;
+        int port = 0;
+        if (socket->server && _ism.get_remote(socket->id, header.addr, &port)) {
+            header.port = port;
+        } else if (!socket->server) {
+            strncpy(header.addr, socket->addr.get_ip_address(), sizeof(header.addr) - 1);
+            header.port = socket->addr.get_port();
+        }
+        memcpy(_datagram, &header, sizeof(header));
+        _datagram_owner = socket;
+        rx_store_datagram(socket);
+        return true;
+    }
+
+    uint32_t tail = (socket->rx_head + socket->rx_len) % ISM43362_SOCKET_RX_SIZE;
+    uint32_t space = ISM43362_SOCKET_RX_SIZE - socket->rx_len;
+    if (space > ISM43362_SOCKET_RX_SIZE - tail) {
+        space = ISM43362_SOCKET_RX_SIZE - tail;
+    }
+    if (space == 0) {
+        // Already signalled when the data arrived
+        return false;
+    }
+
+    // Requests are halved to fit the buffer rather than trimmed, the module
+    // read size (R1) is only sent when it changes
+    uint32_t request = socket->read_size;
+    while (request > space && request > ISM43362_READ_AHEAD_MIN) {
+        request /= 2;
+    }
+    request = min(request, space);
+
+    // The socket state is released during the transfer, the application
+    // only reads the buffer before tail and keeps the head where it is
+    socket->rx_busy = true;
+    _mutex.unlock();
+    int32_t recv = _ism.recv(socket->id, &socket->rx_buf[tail], request, socket->recv_timeout);
+    _mutex.lock();
+    socket->rx_busy = false;
+    if (recv < 0) {
+        return rx_error(socket);
+    }
+    if (recv == 0) {
+        return false;
+    }
+
+    // Read further ahead while reads come back full, and back off once
+    // the traffic only fills a fraction of them
+    if ((uint32_t)recv == socket->read_size && socket->read_size < (uint32_t)ISM43362_READ_AHEAD_MAX) {
+        socket->read_size = min(socket->read_size * 2, (uint32_t)ISM43362_READ_AHEAD_MAX);
+        _read_ahead_grows++;
+    } else if ((uint32_t)recv < request / 4 && socket->read_size > ISM43362_READ_AHEAD_MIN) {
+        socket->read_size /= 2;
+        _read_ahead_shrinks++;
+    }
+
+    socket->rx_len += recv;
+    return true;
+}
+
+void ISM43362Interface::poll()
+{
+    bool signal[ISM43362_SOCKET_COUNT];
+    bool active = false;
+    bool traffic = false;
+    int delay = ISM43362_POLL_MAX_INTERVAL;
+
+    _mutex.lock();
+    uint64_t now = Kernel::get_ms_count();
+
+    // This poll has started, requests made during the round schedule the next one
+    _poll_id = 0;
+
+    // Serve sockets by priority, and round-robin between equal priorities
+    // so that every socket gets its turn
+    int order[ISM43362_SOCKET_COUNT];
+    int count = 0;
+    for (int n = 0; n < ISM43362_SOCKET_COUNT; n++) {
+        int i = (_poll_next + n) % ISM43362_SOCKET_COUNT;
+        signal[i] = false;
+        if (!_sockets[i]) {
+            continue;
+        }
+        int j = count++;
+        for (; j > 0 && _sockets[order[j - 1]]->priority < _sockets[i]->priority; j--) {
+            order[j] = order[j - 1];
+        }
+        order[j] = i;
+    }
+    _poll_next = (_poll_next + 1) % ISM43362_SOCKET_COUNT;
+    _mutex.unlock();
+
+    for (int n = 0; n < count; n++) {
+        int i = order[n];
+
+        // Each socket is served in its own module transaction so that other
+        // threads can use the module in between
+        ScopedLock<ISM43362> module(_ism);
+        ScopedLock<Mutex> lock(_mutex);
+        struct ISM43362_socket *socket = _sockets[i];
+
+        if (!socket || !socket->connected) {
+            continue;
+        }
+        active = true;
+
+        // Data held for coalescing is sent once its deadline expires
+        bool due = socket->tx_len && tx_due(socket, now);
+        if (socket->tx_len && !due) {
+            delay = min(delay, (int)(socket->tx_deadline - now));
+        }
+
+        // A parked socket is reopened when it has data to send, or once a
+        // module socket is free
+        if (socket->id < 0 && socket_unpark(socket, due) < 0) {
+            continue;
+        }
+
+        // Send one chunk of what the application queued, it can queue
+        // more afterwards. The rest waits for the next round so that
+        // other sockets are not held up by a bulk transfer.
+        if (due) {
+            flush_tx(socket);
+            signal[i] = true;
+            traffic = true;
+            if (socket->tx_len) {
+                delay = 0;
+            }
+        }
+
+        // A listening socket only waits for a client to connect
+        if (socket->listening) {
+            if (!socket->accept_pending && poll_accept(socket)) {
+                signal[i] = true;
+                traffic = true;
+            }
+            continue;
+        }
+
+        // Drain what the module holds for the socket into its buffer
+        if (poll_rx(socket)) {
+            signal[i] = true;
+            traffic = true;
+        }
+    }
+
+    _mutex.lock();
+
+    // Poll quickly while data is flowing and back off exponentially when idle
+    if (traffic) {
+        _poll_interval = ISM43362_POLL_MIN_INTERVAL;
+    } else if (_poll_interval < ISM43362_POLL_MAX_INTERVAL) {
+        _poll_interval = min(_poll_interval * 2, ISM43362_POLL_MAX_INTERVAL);
+    }
+
+    if (active) {
+        poll_in(min(_poll_interval, delay));
+    }
+
+    struct {
+        void (*callback)(void *);
+        void *data;
+    } cbs[ISM43362_SOCKET_COUNT];
+    memcpy(cbs, _cbs, sizeof(cbs));
+    _mutex.unlock();
+
+    for (int i = 0; i < ISM43362_SOCKET_COUNT; i++) {
+        if (signal[i] && cbs[i].callback) {
+            cbs[i].callback(cbs[i].data);
+        }
+    }
+}
+
+void ISM43362Interface::event_irq()
+{
+    // Only one event is queued at a time, it reads everything pending
+    if (!_event_pending) {
+        _event_pending = true;
+        _queue.call(this, &ISM43362Interface::event);
+    }
 }
 
 void ISM43362Interface::event() {
+    _event_pending = false;
+    if (!_ism.process_events()) {
+        // Without an event report the module may still hold data for the
+        // sockets, the poller reads it
+        poll_now();
+        return;
+    }
+
+    // The module reports closed connections and a lost access point on its
+    // own, check the link rather than waiting for a command to time out
+    _ism.lock();
+    bool connected = _ism.isConnected();
+    _mutex.lock();
+    if (!connected) {
+        for (int i = 0; i < ISM43362_SOCKET_COUNT; i++) {
+            struct ISM43362_socket *socket = _sockets[i];
+            if (socket && socket->connected) {
+                socket->connected = false;
+                socket->listening = false;
+                socket->error = NSAPI_ERROR_CONNECTION_LOST;
+            }
+        }
+    }
+
+    struct {
+        void (*callback)(void *);
+        void *data;
+    } cbs[ISM43362_SOCKET_COUNT];
+    memcpy(cbs, _cbs, sizeof(cbs));
+    _mutex.unlock();
+    _ism.unlock();
+
+    // Connections closed by their peer fail their next read, which the
+    // poller reports to the socket
+    poll_now();
+
     for (int i = 0; i < ISM43362_SOCKET_COUNT; i++) {
-        if (_cbs[i].callback) {
-            _cbs[i].callback(_cbs[i].data);
+        if (cbs[i].callback) {
+            cbs[i].callback(cbs[i].data);
         }
     }
 }
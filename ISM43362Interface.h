@@ -20,8 +20,119 @@
 #include "mbed.h"
 #include "ISM43362.h"
 
+struct ISM43362_socket;
 
-#define ISM43362_SOCKET_COUNT 5
+/* Number of sockets of the interface, sockets beyond the module ones
+ * (ES_WIFI_SOCKET_COUNT) are multiplexed: idle UDP sockets are parked
+ * to let other sockets use the module
+ */
+#ifndef ISM43362_SOCKET_COUNT
+#define ISM43362_SOCKET_COUNT 8
+#endif
+
+/* Size of the receive buffer of each socket */
+#ifndef ISM43362_SOCKET_RX_SIZE
+#define ISM43362_SOCKET_RX_SIZE 1024
+#endif
+
+/* Size of the transmit buffer of each socket */
+#ifndef ISM43362_SOCKET_TX_SIZE
+#define ISM43362_SOCKET_TX_SIZE 1024
+#endif
+
+/* Interval of the receive poller while data is flowing */
+#ifndef ISM43362_POLL_MIN_INTERVAL
+#define ISM43362_POLL_MIN_INTERVAL 10 /* milliseconds */
+#endif
+
+/* Interval of the receive poller once sockets are idle */
+#ifndef ISM43362_POLL_MAX_INTERVAL
+#define ISM43362_POLL_MAX_INTERVAL 500 /* milliseconds */
+#endif
+
+/* Number of hostnames kept in the DNS result cache */
+#ifndef ISM43362_DNS_CACHE_SIZE
+#define ISM43362_DNS_CACHE_SIZE 4
+#endif
+
+/* Time a cached DNS result stays valid, 0 disables the cache */
+#ifndef ISM43362_DNS_CACHE_TTL
+#define ISM43362_DNS_CACHE_TTL 300000 /* milliseconds */
+#endif
+
+/* Longest hostname that is stored in the DNS cache */
+#define ISM43362_DNS_NAME_SIZE 64
+
+/* Number of asynchronous DNS requests that can be pending at the same time */
+#ifndef ISM43362_DNS_ASYNC_COUNT
+#define ISM43362_DNS_ASYNC_COUNT 4
+#endif
+
+/* Size of the DNS event queue, each pending request holds an event and its
+ * bound callback
+ */
+#define ISM43362_DNS_QUEUE_SIZE \
+    (ISM43362_DNS_ASYNC_COUNT * (EVENTS_EVENT_SIZE + sizeof(mbed::Callback<void()>) + 2 * sizeof(void *)))
+
+/* Stack size of the driver worker thread */
+#ifndef ISM43362_THREAD_STACK_SIZE
+#define ISM43362_THREAD_STACK_SIZE 2048
+#endif
+
+/* Stack size of the thread running the asynchronous DNS lookups and their callbacks */
+#ifndef ISM43362_DNS_THREAD_STACK_SIZE
+#define ISM43362_DNS_THREAD_STACK_SIZE 2048
+#endif
+
+/* Stack size of the thread printing the AT log, only started with debug enabled */
+#ifndef ISM43362_LOG_THREAD_STACK_SIZE
+#define ISM43362_LOG_THREAD_STACK_SIZE 1024
+#endif
+
+/* Smallest read requested from the module for a TCP socket, the read
+ * size doubles while reads come back full
+ */
+#ifndef ISM43362_READ_AHEAD_MIN
+#define ISM43362_READ_AHEAD_MIN 64
+#endif
+
+/* Largest module write of a socket per polling round, larger transfers
+ * are split so that other sockets are served in between
+ */
+#ifndef ISM43362_SEND_CHUNK_SIZE
+#define ISM43362_SEND_CHUNK_SIZE 512
+#endif
+
+/* Time small TCP sends are held to be merged into one module write,
+ * 0 sends them as soon as possible
+ */
+#ifndef ISM43362_SEND_COALESCE_DELAY
+#define ISM43362_SEND_COALESCE_DELAY 20 /* milliseconds */
+#endif
+
+/* Interval at which the log thread prints the AT exchanges recorded
+ * when the interface is created with debug enabled
+ */
+#ifndef ISM43362_LOG_INTERVAL
+#define ISM43362_LOG_INTERVAL 100 /* milliseconds */
+#endif
+
+/* Interval of the periodic dump of the command latency when AT_TRACE is
+ * enabled, 0 disables the dump
+ */
+#ifndef ISM43362_TRACE_DUMP_INTERVAL
+#define ISM43362_TRACE_DUMP_INTERVAL 0 /* milliseconds */
+#endif
+
+/* Socket options of the NSAPI_SOCKET level specific to this driver,
+ * the value is an int in milliseconds
+ */
+enum ism43362_socket_option {
+    ISM43362_SNDTIMEO = 0x1000, /* Time the module may take to send the data of a socket */
+    ISM43362_RCVTIMEO,          /* Time the module may take to read the data of a socket */
+    ISM43362_NODELAY,           /* Non-zero sends the data of a TCP socket without coalescing it */
+    ISM43362_PRIORITY,          /* Sockets of higher priority are served first, 0 by default */
+};
 
 /** ISM43362Interface class
  *  Implementation of the NetworkStack for the ISM43362
@@ -35,8 +146,9 @@ public:
      * @param clk        CLOCK pin
      * @param nss        NSS pin
      * @param debug     Enable debugging
+     * @param async_init Boot the module from the driver thread instead of blocking the constructor
      */
-    ISM43362Interface(PinName mosi, PinName miso, PinName clk, PinName nss, PinName reset, PinName dataready, PinName wakeup, bool debug = false);
+    ISM43362Interface(PinName mosi, PinName miso, PinName clk, PinName nss, PinName reset, PinName dataready, PinName wakeup, bool debug = false, bool async_init = false);
 
     /** Start the interface
      *
@@ -54,7 +166,7 @@ public:
      *  @param ssid      Name of the network to connect to
      *  @param pass      Security passphrase to connect to the network
      *  @param security  Type of encryption for connection (Default: NSAPI_SECURITY_NONE)
-     *  @param channel   This parameter is not supported, setting it to anything else than 0 will result in NSAPI_ERROR_UNSUPPORTED
+     *  @param channel   Channel on which the connection is to be made, or 0 for any (Default: 0)
      *  @return          0 on success, or error code on failure
      */
     virtual int connect(const char *ssid, const char *pass, nsapi_security_t security = NSAPI_SECURITY_NONE,
@@ -73,6 +185,55 @@ public:
      *  @return         0 on success, negative error code on failure
      */
     virtual nsapi_error_t gethostbyname(const char *name, SocketAddress *address, nsapi_version_t version = NSAPI_UNSPEC);
+
+    /** Translates a hostname to an IP address (asynchronous)
+     *
+     *  The lookup is queued to a DNS thread of the driver and the callback is
+     *  called from that thread once the module has answered, the socket
+     *  poller keeps running meanwhile. The module itself runs one command at
+     *  a time, so socket transfers wait for it while it resolves the name.
+     *  If the hostname is an IP address or is found in the DNS cache, the
+     *  callback is called before this function returns.
+     *
+     *  @param host     Hostname to resolve
+     *  @param callback Callback that is called for result
+     *  @param version  IP version of address to resolve, NSAPI_UNSPEC indicates
+     *                  version is chosen by the stack (defaults to NSAPI_UNSPEC)
+     *  @return         0 on immediate success,
+     *                  negative error code on immediate failure or
+     *                  a positive unique id that represents the hostname translation operation
+     *                  and can be passed to cancel
+     */
+    virtual nsapi_value_or_error_t gethostbyname_async(const char *host, NetworkStack::hostbyname_cb_t callback,
+                                                       nsapi_version_t version = NSAPI_UNSPEC);
+
+    /** Cancels asynchronous hostname translation
+     *
+     *  When translation is cancelled, callback will not be called.
+     *
+     *  @param id       Unique id of the hostname translation operation
+     *  @return         0 on success, negative error code on failure
+     */
+    virtual nsapi_error_t gethostbyname_async_cancel(int id);
+
+    /** Set the lifetime of DNS cache entries
+     *
+     *  Entries older than the ttl are resolved again by the module.
+     *
+     *  @param ttl_ms    Lifetime of an entry in milliseconds, 0 disables caching
+     */
+    void set_dns_cache_ttl(uint32_t ttl_ms);
+
+    /** Drop every entry of the DNS cache
+     */
+    void flush_dns_cache();
+
+    /** Get the DNS cache counters
+     *
+     *  @param hits      Destination for the number of lookups served from the cache
+     *  @param misses    Destination for the number of lookups sent to the module
+     */
+    void get_dns_cache_stats(uint32_t *hits, uint32_t *misses);
     
     /** Set the WiFi network credentials
      *
@@ -84,15 +245,64 @@ public:
      */
     virtual int set_credentials(const char *ssid, const char *pass, nsapi_security_t security = NSAPI_SECURITY_NONE);
 
-    /** Set the WiFi network channel - NOT SUPPORTED
+    /** Set the WiFi network channel
      *
-     * This function is not supported and will return NSAPI_ERROR_UNSUPPORTED
+     *  The module only scans this channel when joining the network.
      *
      *  @param channel   Channel on which the connection is to be made, or 0 for any (Default: 0)
-     *  @return          Not supported, returns NSAPI_ERROR_UNSUPPORTED
+     *  @return          0 on success, or error code on failure
      */
     virtual int set_channel(uint8_t channel);
 
+    /** Enable/Disable fast reconnect
+     *
+     *  When enabled, the channel, BSSID and security of the access point
+     *  learnt from scan() or from the last successful connection are used
+     *  to join it without a full scan, falling back to a full scan if this
+     *  fails. After a full join, the driver thread scans for the network
+     *  once to learn its access point. The module auto connect is enabled
+     *  too, so that it joins the network again on its own after a loss of
+     *  the AP.
+     *
+     *  @param enabled   Fast reconnect enabled when true (Default: disabled)
+     */
+    void set_fast_reconnect(bool enabled);
+
+    /** Get the duration of the last successful connection
+     *
+     *  @return          Milliseconds spent in the last successful connect(), or -1 if none
+     */
+    int get_connect_time();
+
+    /** Get the cost of socket multiplexing
+     *
+     *  When more sockets are in use than the module has, idle UDP sockets
+     *  are parked and reopened on demand.
+     *
+     *  @param count     Destination for the number of sockets parked so far
+     *  @param time_us   Destination for the total time spent parking and reopening sockets
+     */
+    void get_socket_swap_stats(uint32_t *count, uint32_t *time_us);
+
+    /** Get the adjustments of the TCP read-ahead
+     *
+     *  @param grows     Destination for the number of times a socket read size was doubled
+     *  @param shrinks   Destination for the number of times a socket read size was halved
+     */
+    void get_read_ahead_stats(uint32_t *grows, uint32_t *shrinks);
+
+    /** Get the latency of the commands sent to the module
+     *
+     *  Only recorded when the driver is built with AT_TRACE enabled, the
+     *  time of each command is split in waiting for the module lock,
+     *  sending, module processing and reading the response.
+     *
+     *  @param stats     Destination for the latency of each command
+     *  @param count     Number of entries stats can hold
+     *  @return          Number of entries copied
+     */
+    int get_command_latency(ATParser::latency *stats, int count);
+
     /** Stop the interface
      *  @return             0 on success, negative on failure
      */
@@ -122,12 +332,53 @@ public:
      */
     virtual const char *get_netmask();
 
+    /** Set a static IP address
+     *
+     *  Configures this network interface to use a static IP address and
+     *  disables DHCP. The configuration is programmed in the module on the
+     *  next connect.
+     *
+     *  @param ip_address Null-terminated representation of the local IP address
+     *  @param netmask    Null-terminated representation of the local network mask
+     *  @param gateway    Null-terminated representation of the local gateway
+     *  @return           0 on success, negative error code on failure
+     */
+    virtual nsapi_error_t set_network(const char *ip_address, const char *netmask, const char *gateway);
+
+    /** Enable or disable DHCP on the network
+     *
+     *  Enables DHCP on connecting the network. Defaults to enabled unless
+     *  a static IP address has been assigned.
+     *
+     *  @param dhcp     True to enable DHCP
+     *  @return         0 on success, negative error code on failure
+     */
+    virtual nsapi_error_t set_dhcp(bool dhcp);
+
+    /** Add a domain name server to list of servers to query
+     *
+     *  The module accepts a primary and a secondary server, further
+     *  servers replace the secondary one.
+     *
+     *  @param address  Address of the domain name server
+     *  @return         0 on success, negative error code on failure
+     */
+    virtual nsapi_error_t add_dns_server(const SocketAddress &address);
+
     /** Gets the current radio signal strength for active connection
      *
      * @return          Connection strength in dBm (negative value)
      */
     virtual int8_t get_rssi();
 
+    /** Get the time the module took to boot
+     *
+     *  Waits for the initialization to complete if it runs asynchronously.
+     *
+     *  @return         Milliseconds from reset to the boot prompt, negative if the boot failed
+     */
+    int get_boot_time();
+
     /** Scan for available networks
      *
      * This function will block.
@@ -156,13 +407,6 @@ public:
      */
     using NetworkInterface::gethostbyname;
 
-    /** Add a domain name server to list of servers to query
-     *
-     *  @param addr     Destination for the host address
-     *  @return         0 on success, negative error code on failure
-     */
-    using NetworkInterface::add_dns_server;
-
 protected:
     /** Open a socket
      *  @param handle       Handle in which to store new socket
@@ -262,6 +506,28 @@ protected:
      */
     virtual void socket_attach(void *handle, void (*callback)(void *), void *data);
 
+    /** Set a socket option
+     *  @param handle       Socket handle
+     *  @param level        Option level, NSAPI_SOCKET for the ism43362_socket_option options
+     *  @param optname      Option identifier
+     *  @param optval       Option value
+     *  @param optlen       Length of the option value
+     *  @return             0 on success, negative error code on failure
+     */
+    virtual nsapi_error_t setsockopt(nsapi_socket_t handle, int level,
+                                     int optname, const void *optval, unsigned optlen);
+
+    /** Get a socket option
+     *  @param handle       Socket handle
+     *  @param level        Option level
+     *  @param optname      Option identifier
+     *  @param optval       Destination for option value
+     *  @param optlen       Length of the option value
+     *  @return             0 on success, negative error code on failure
+     */
+    virtual nsapi_error_t getsockopt(nsapi_socket_t handle, int level,
+                                     int optname, void *optval, unsigned *optlen);
+
     /** Provide access to the NetworkStack object
      *
      *  @return The underlying NetworkStack object
@@ -273,14 +539,106 @@ protected:
 
 private:
     ISM43362 _ism;
-    bool _ids[ISM43362_SOCKET_COUNT];
+    // Interface and socket state. Paths that use the module take the module
+    // lock first, socket reads and writes only need this one.
+    Mutex _mutex;
+    EventQueue _queue;
+    Thread _thread;
+    EventFlags _flags;
+    struct ISM43362_socket *_sockets[ISM43362_SOCKET_COUNT];
+    struct ISM43362_socket *_modules[ES_WIFI_SOCKET_COUNT];
+    uint32_t _swap_count;
+    uint32_t _swap_time;
+    uint32_t _read_ahead_grows;
+    uint32_t _read_ahead_shrinks;
+    // Datagram read by the poller, waiting for room in the buffer of its socket
+    char *_datagram;
+    struct ISM43362_socket *_datagram_owner;
+    // Network configuration, guarded by the module lock so that connect()
+    // reads it without holding the socket state
     char ap_ssid[33]; /* 32 is what 802.11 defines as longest possible name; +1 for the \0 */
     nsapi_security_t ap_sec;
     uint8_t ap_ch;
     char ap_pass[64]; /* The longest allowed passphrase */
 
+    // Access point remembered for fast reconnect
+    struct {
+        bool valid;
+        char ssid[33];
+        uint8_t bssid[6];
+        uint8_t channel;
+        nsapi_security_t security;
+    } _last_ap;
+    bool _dhcp;
+    char _ip[NSAPI_IPv4_SIZE];
+    char _netmask[NSAPI_IPv4_SIZE];
+    char _gateway[NSAPI_IPv4_SIZE];
+    char _dns[2][NSAPI_IPv4_SIZE];
+    int _dns_count;
+    bool _fast_reconnect;
+    bool _fw_checked;
+    int _connect_time;
+
+    volatile bool _event_pending;
+    void event_irq();
     void event();
 
+    uint16_t _next_port;
+    int _poll_id;
+    int _poll_interval;
+    uint64_t _poll_time;
+    int _poll_next;
+    void poll();
+    void poll_now();
+    void poll_in(int delay);
+    bool flush_tx(struct ISM43362_socket *socket);
+    int socket_open_server(struct ISM43362_socket *socket);
+    int socket_prepare_sendto(struct ISM43362_socket *socket, const SocketAddress &addr);
+    bool poll_rx(struct ISM43362_socket *socket);
+    bool rx_error(struct ISM43362_socket *socket);
+    bool rx_store_datagram(struct ISM43362_socket *socket);
+    bool poll_accept(struct ISM43362_socket *socket);
+    int socket_acquire(struct ISM43362_socket *socket, bool evict);
+    void socket_release(struct ISM43362_socket *socket);
+    bool socket_park(struct ISM43362_socket *socket);
+    int socket_unpark(struct ISM43362_socket *socket, bool evict);
+    void init();
+    void wait_init();
+    void learn_ap();
+
+    struct dns_entry {
+        char name[ISM43362_DNS_NAME_SIZE];
+        nsapi_version_t version;
+        char ip[NSAPI_IP_SIZE];
+        uint64_t expires;
+        uint64_t last_used;
+    } _dns_cache[ISM43362_DNS_CACHE_SIZE];
+    uint32_t _dns_ttl;
+    uint32_t _dns_hits;
+    uint32_t _dns_misses;
+
+    const char *dns_cache_find(const char *name, nsapi_version_t version);
+    void dns_cache_insert(const char *name, nsapi_version_t version, const char *ip);
+
+    struct dns_request {
+        bool in_use;
+        int id;
+        bool cancelled;
+        char name[ISM43362_DNS_NAME_SIZE];
+        nsapi_version_t version;
+        NetworkStack::hostbyname_cb_t callback;
+    } _dns_requests[ISM43362_DNS_ASYNC_COUNT];
+    Mutex _dns_mutex;
+    // Lookups block for up to the DNS timeout, they do not run on the poller thread
+    EventQueue _dns_queue;
+    Thread _dns_thread;
+
+    void dns_async_worker(int slot);
+
+    // Printing the log is slow, it runs below the driver and the application
+    Thread _log_thread;
+    void log_worker();
+
     struct {
         void (*callback)(void *);
         void *data;
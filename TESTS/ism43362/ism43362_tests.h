@@ -0,0 +1,62 @@
+/* Configuration shared by the ISM43362 target tests
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ISM43362_TESTS_H
+#define ISM43362_TESTS_H
+
+#include "ISM43362Interface.h"
+
+#if !defined(MBED_CFG_ISM43362_SSID) || !defined(MBED_CFG_ISM43362_PASS)
+#error "MBED_CFG_ISM43362_SSID and MBED_CFG_ISM43362_PASS must be defined"
+#endif
+
+#ifndef MBED_CFG_ISM43362_ECHO_SERVER
+#error "MBED_CFG_ISM43362_ECHO_SERVER must be defined, a TCP and UDP echo server"
+#endif
+
+#ifndef MBED_CFG_ISM43362_ECHO_PORT
+#define MBED_CFG_ISM43362_ECHO_PORT 7
+#endif
+
+// Defaults for the DISCO_L475VG_IOT01A
+#ifndef MBED_CFG_ISM43362_WIFI_MOSI
+#define MBED_CFG_ISM43362_WIFI_MOSI PC_12
+#endif
+#ifndef MBED_CFG_ISM43362_WIFI_MISO
+#define MBED_CFG_ISM43362_WIFI_MISO PC_11
+#endif
+#ifndef MBED_CFG_ISM43362_WIFI_SCLK
+#define MBED_CFG_ISM43362_WIFI_SCLK PC_10
+#endif
+#ifndef MBED_CFG_ISM43362_WIFI_NSS
+#define MBED_CFG_ISM43362_WIFI_NSS PE_0
+#endif
+#ifndef MBED_CFG_ISM43362_WIFI_RESET
+#define MBED_CFG_ISM43362_WIFI_RESET PE_8
+#endif
+#ifndef MBED_CFG_ISM43362_WIFI_DATAREADY
+#define MBED_CFG_ISM43362_WIFI_DATAREADY PE_1
+#endif
+#ifndef MBED_CFG_ISM43362_WIFI_WAKEUP
+#define MBED_CFG_ISM43362_WIFI_WAKEUP PB_13
+#endif
+
+#define ISM43362_TEST_INTERFACE(name) \
+    ISM43362Interface name(MBED_CFG_ISM43362_WIFI_MOSI, MBED_CFG_ISM43362_WIFI_MISO, \
+                           MBED_CFG_ISM43362_WIFI_SCLK, MBED_CFG_ISM43362_WIFI_NSS, \
+                           MBED_CFG_ISM43362_WIFI_RESET, MBED_CFG_ISM43362_WIFI_DATAREADY, \
+                           MBED_CFG_ISM43362_WIFI_WAKEUP)
+
+#endif
@@ -0,0 +1,118 @@
+/* Benchmark of the socket multiplexing of the ISM43362 driver
+ *
+ * UDP sockets take turns echoing a datagram through an echo server, first
+ * as many sockets as the module has, then as many as the interface has.
+ * The time per echo and the swap counters of each run are printed, the
+ * difference between the runs is the cost of parking and reopening.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "mbed.h"
+#include "greentea-client/test_env.h"
+#include "unity.h"
+#include "utest.h"
+#include "../ism43362_tests.h"
+
+using namespace utest::v1;
+
+#ifndef SWAP_ROUNDS
+#define SWAP_ROUNDS 20
+#endif
+
+#define SWAP_DATAGRAM_SIZE 64
+
+static ISM43362_TEST_INTERFACE(wifi);
+
+static void run_sockets(int count)
+{
+    UDPSocket socks[ISM43362_SOCKET_COUNT];
+    char tx[SWAP_DATAGRAM_SIZE];
+    char rx[SWAP_DATAGRAM_SIZE];
+    int echoed = 0;
+    int lost = 0;
+    uint32_t swaps_before, time_before, swaps, time_us;
+    Timer timer;
+
+    for (int i = 0; i < count; i++) {
+        TEST_ASSERT_EQUAL_INT(NSAPI_ERROR_OK, socks[i].open(&wifi));
+        socks[i].set_timeout(2000);
+    }
+
+    wifi.get_socket_swap_stats(&swaps_before, &time_before);
+    timer.start();
+    for (int round = 0; round < SWAP_ROUNDS; round++) {
+        for (int i = 0; i < count; i++) {
+            memset(tx, 'a' + i, sizeof(tx));
+            int ret = socks[i].sendto(MBED_CFG_ISM43362_ECHO_SERVER, MBED_CFG_ISM43362_ECHO_PORT, tx, sizeof(tx));
+            TEST_ASSERT_EQUAL_INT(sizeof(tx), ret);
+
+            // UDP may drop a datagram, only a wrong answer fails the test
+            ret = socks[i].recvfrom(NULL, rx, sizeof(rx));
+            if (ret == NSAPI_ERROR_WOULD_BLOCK) {
+                lost++;
+                continue;
+            }
+            TEST_ASSERT_EQUAL_INT(sizeof(tx), ret);
+            TEST_ASSERT_EQUAL_INT(0, memcmp(tx, rx, sizeof(tx)));
+            echoed++;
+        }
+    }
+    timer.stop();
+    wifi.get_socket_swap_stats(&swaps, &time_us);
+
+    for (int i = 0; i < count; i++) {
+        socks[i].close();
+    }
+
+    printf("%d sockets: %d echoes (%d lost) in %d ms, %d us per echo, "
+           "%lu swaps taking %lu us\r\n", count, echoed, lost, timer.read_ms(),
+           echoed ? timer.read_us() / echoed : 0,
+           (unsigned long)(swaps - swaps_before), (unsigned long)(time_us - time_before));
+    TEST_ASSERT(echoed > 0);
+}
+
+static void test_connect()
+{
+    int ret = wifi.connect(MBED_CFG_ISM43362_SSID, MBED_CFG_ISM43362_PASS, NSAPI_SECURITY_WPA2);
+    TEST_ASSERT_EQUAL_INT(NSAPI_ERROR_OK, ret);
+}
+
+static void test_module_sockets()
+{
+    run_sockets(ES_WIFI_SOCKET_COUNT);
+}
+
+static void test_swapped_sockets()
+{
+    run_sockets(ISM43362_SOCKET_COUNT);
+}
+
+utest::v1::status_t test_setup(const size_t number_of_cases)
+{
+    GREENTEA_SETUP(240, "default_auto");
+    return verbose_test_setup_handler(number_of_cases);
+}
+
+Case cases[] = {
+    Case("connect", test_connect),
+    Case("module sockets", test_module_sockets),
+    Case("swapped sockets", test_swapped_sockets),
+};
+
+Specification specification(test_setup, cases);
+
+int main()
+{
+    return !Harness::run(specification);
+}
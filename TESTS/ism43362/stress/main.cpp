@@ -0,0 +1,171 @@
+/* Stress test of the ISM43362 driver locking
+ *
+ * 1, 2 and 4 client threads each echo a pattern of their own through a
+ * TCP echo server at the same time. Every byte must come back in order on
+ * its own socket, and the throughput of each run is printed.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "mbed.h"
+#include "greentea-client/test_env.h"
+#include "unity.h"
+#include "utest.h"
+#include "../ism43362_tests.h"
+
+using namespace utest::v1;
+
+#ifndef STRESS_BLOCK_SIZE
+#define STRESS_BLOCK_SIZE 256
+#endif
+
+#ifndef STRESS_CLIENT_BYTES
+#define STRESS_CLIENT_BYTES 16384
+#endif
+
+#define STRESS_THREAD_STACK_SIZE 2048
+#define STRESS_MAX_CLIENTS 4
+
+static ISM43362_TEST_INTERFACE(wifi);
+
+struct client {
+    int id;
+    int echoed;
+    int error;
+};
+
+static char pattern(int id, int offset)
+{
+    return (char)('a' + (id * 7 + offset) % 26);
+}
+
+static void client_run(client *c)
+{
+    TCPSocket sock;
+    char tx[STRESS_BLOCK_SIZE];
+    char rx[STRESS_BLOCK_SIZE];
+
+    c->echoed = 0;
+    c->error = sock.open(&wifi);
+    if (c->error) {
+        return;
+    }
+    sock.set_timeout(10000);
+    c->error = sock.connect(MBED_CFG_ISM43362_ECHO_SERVER, MBED_CFG_ISM43362_ECHO_PORT);
+    if (c->error) {
+        sock.close();
+        return;
+    }
+
+    while (c->echoed < STRESS_CLIENT_BYTES) {
+        for (int i = 0; i < STRESS_BLOCK_SIZE; i++) {
+            tx[i] = pattern(c->id, c->echoed + i);
+        }
+        for (int sent = 0; sent < STRESS_BLOCK_SIZE; ) {
+            int ret = sock.send(tx + sent, STRESS_BLOCK_SIZE - sent);
+            if (ret < 0) {
+                c->error = ret;
+                sock.close();
+                return;
+            }
+            sent += ret;
+        }
+        for (int recvd = 0; recvd < STRESS_BLOCK_SIZE; ) {
+            int ret = sock.recv(rx + recvd, STRESS_BLOCK_SIZE - recvd);
+            if (ret <= 0) {
+                c->error = ret ? ret : NSAPI_ERROR_NO_CONNECTION;
+                sock.close();
+                return;
+            }
+            recvd += ret;
+        }
+        // Data of another client or out of order data breaks the pattern
+        if (memcmp(tx, rx, STRESS_BLOCK_SIZE) != 0) {
+            c->error = NSAPI_ERROR_DEVICE_ERROR;
+            break;
+        }
+        c->echoed += STRESS_BLOCK_SIZE;
+    }
+    sock.close();
+}
+
+static void run_clients(int count)
+{
+    client clients[STRESS_MAX_CLIENTS];
+    Thread *threads[STRESS_MAX_CLIENTS];
+    Timer timer;
+
+    timer.start();
+    for (int i = 0; i < count; i++) {
+        clients[i].id = i;
+        threads[i] = new Thread(osPriorityNormal, STRESS_THREAD_STACK_SIZE);
+        threads[i]->start(callback(client_run, &clients[i]));
+    }
+
+    int total = 0;
+    for (int i = 0; i < count; i++) {
+        threads[i]->join();
+        delete threads[i];
+        total += clients[i].echoed;
+    }
+    timer.stop();
+
+    printf("%d client(s): %d bytes echoed in %d ms, %d bytes/s\r\n", count, total,
+           timer.read_ms(), (int)(total / timer.read()));
+
+    for (int i = 0; i < count; i++) {
+        TEST_ASSERT_EQUAL_INT(NSAPI_ERROR_OK, clients[i].error);
+        TEST_ASSERT_EQUAL_INT(STRESS_CLIENT_BYTES, clients[i].echoed);
+    }
+}
+
+static void test_connect()
+{
+    int ret = wifi.connect(MBED_CFG_ISM43362_SSID, MBED_CFG_ISM43362_PASS, NSAPI_SECURITY_WPA2);
+    TEST_ASSERT_EQUAL_INT(NSAPI_ERROR_OK, ret);
+}
+
+static void test_1_client()
+{
+    run_clients(1);
+}
+
+static void test_2_clients()
+{
+    run_clients(2);
+}
+
+static void test_4_clients()
+{
+    run_clients(4);
+}
+
+utest::v1::status_t test_setup(const size_t number_of_cases)
+{
+    GREENTEA_SETUP(240, "default_auto");
+    return verbose_test_setup_handler(number_of_cases);
+}
+
+Case cases[] = {
+    Case("connect", test_connect),
+    Case("1 client", test_1_client),
+    Case("2 clients", test_2_clients),
+    Case("4 clients", test_4_clients),
+};
+
+Specification specification(test_setup, cases);
+
+int main()
+{
+    return !Harness::run(specification);
+}